@@ -0,0 +1,346 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <numeric>
+#include <print>
+#include <random>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "./src/child_index.hpp"
+#include "./src/leaf_map.hpp"
+
+using bench_clock = std::chrono::steady_clock;
+
+// Nanoseconds per operation of `ops` operations run by `fn`
+template <typename F>
+double ns_per_op(std::size_t ops, F &&fn)
+{
+  auto start = bench_clock::now();
+  fn();
+  auto elapsed = std::chrono::duration<double, std::nano>(bench_clock::now() - start).count();
+  return elapsed / static_cast<double>(ops);
+}
+
+// Keeps the optimizer from dropping benchmark results
+static volatile uintptr_t sink;
+
+// Child lookup layout Node used before Child_index: sorted {id, child} pairs searched with lower_bound
+struct Sorted_children
+{
+  std::vector<std::pair<uint64_t, int *>> _nodes;
+
+  void insert(uint32_t id, int *child)
+  {
+    auto it = std::ranges::lower_bound(_nodes, id, {}, [](const auto &pair) { return pair.first; });
+    _nodes.insert(it, {id, child});
+  }
+
+  int *find(uint32_t id) const
+  {
+    auto it = std::ranges::lower_bound(_nodes, id, {}, [](const auto &pair) { return pair.first; });
+    return it != _nodes.end() && it->first == id ? it->second : nullptr;
+  }
+};
+
+// Leaf_map hash before Wyhash: one multiply per byte
+static uint64_t bytewise_hash(std::string_view s)
+{
+  uint64_t hash = 0xa0761d6478bd642fULL ^ s.size();
+  for (char c : s)
+    hash = (hash ^ uint8_t(c)) * 0xe7037ed1a0b428dbULL;
+  hash ^= (hash >> 33);
+  return hash;
+}
+
+// Leaf_map layout before group probing: control byte stored inline with the strings, probed one bucket at a time
+struct Linear_leaf_map
+{
+  struct bucket
+  {
+    uint8_t ctrl = 0x80;
+    std::string key;
+    std::string value;
+  };
+
+  std::vector<bucket> _store;
+  std::size_t _mask;
+
+  // Fixed capacity, the benchmark fills it to a chosen load without growing
+  explicit Linear_leaf_map(std::size_t cap) : _store(cap), _mask(cap - 1) {}
+
+  void put(std::string_view k, std::string_view v)
+  {
+    uint64_t h = Wyhash{}(k);
+    uint8_t fp = static_cast<uint8_t>(h >> 57);
+    for (std::size_t idx = h & _mask;; idx = (idx + 1) & _mask)
+    {
+      bucket &b = _store[idx];
+      if (b.ctrl & 0x80)
+      {
+        b.ctrl = fp;
+        b.key = k;
+        b.value = v;
+        return;
+      }
+      if (b.ctrl == fp && b.key.size() == k.size() && b.key == k)
+      {
+        b.value = v;
+        return;
+      }
+    }
+  }
+
+  std::string *get(std::string_view k)
+  {
+    uint64_t h = Wyhash{}(k);
+    uint8_t fp = static_cast<uint8_t>(h >> 57);
+    for (std::size_t idx = h & _mask;; idx = (idx + 1) & _mask)
+    {
+      bucket &b = _store[idx];
+      if (b.ctrl & 0x80)
+        return nullptr;
+      if (b.ctrl == fp && b.key.size() == k.size() && b.key == k)
+        return &b.value;
+    }
+  }
+};
+
+void bench_hash()
+{
+  constexpr std::size_t KEYS = 4096;
+  constexpr std::size_t ROUNDS = 256;
+
+  std::println("== Key hashing by key length (ns/hash) ==");
+  std::println("{:>6} {:>10} {:>10} {:>10} {:>10}", "bytes", "bytewise", "Wyhash", "Xxhash64", "std::hash");
+
+  std::mt19937 rng(11);
+  for (std::size_t len : {4, 8, 16, 24, 40, 64, 100, 200, 1000})
+  {
+    std::vector<std::string> keys(KEYS, std::string(len, ' '));
+    for (auto &k : keys)
+      for (auto &c : k) c = static_cast<char>('a' + rng() % 26);
+
+    auto run = [&](auto hash) {
+      return ns_per_op(KEYS * ROUNDS, [&] {
+        for (std::size_t r = 0; r < ROUNDS; ++r)
+          for (const auto &k : keys) sink = sink + hash(k);
+      });
+    };
+
+    std::println("{:>6} {:>10.1f} {:>10.1f} {:>10.1f} {:>10.1f}", len, run(bytewise_hash), run(Wyhash{}),
+                 run(Xxhash64{}), run(std::hash<std::string_view>{}));
+  }
+  std::println("");
+}
+
+void bench_leaf_probe()
+{
+  constexpr std::size_t CAP = 1 << 20;
+  constexpr std::size_t LOOKUPS = 2'000'000;
+
+  std::println("== Leaf_map probing: per-bucket linear vs 16-wide control groups ({} slots, ns/op) ==", CAP);
+  std::println("{:>6} {:>12} {:>12} {:>12} {:>12}", "load", "hit old", "hit new", "miss old", "miss new");
+
+  std::mt19937 rng(7);
+  for (double load : {0.5, 0.75, 0.85, 0.875})
+  {
+    std::size_t n = static_cast<std::size_t>(CAP * load);
+    std::vector<std::string> keys(n);
+    for (std::size_t i = 0; i < n; ++i) keys[i] = "users/" + std::to_string(rng()) + "/session:" + std::to_string(i);
+
+    std::vector<std::string> hits(LOOKUPS / 4), misses(LOOKUPS / 4);
+    for (auto &k : hits) k = keys[rng() % n];
+    for (std::size_t i = 0; i < misses.size(); ++i) misses[i] = "users/absent/" + std::to_string(i);
+
+    Linear_leaf_map old_map(CAP);
+    Leaf_map new_map(CAP);
+    for (const auto &k : keys)
+    {
+      old_map.put(k, "value");
+      new_map.put(k, "value");
+    }
+
+    auto run = [&](auto &map, const std::vector<std::string> &probes) {
+      return ns_per_op(LOOKUPS, [&] {
+        for (std::size_t r = 0; r < 4; ++r)
+          for (const auto &k : probes) sink = sink + static_cast<bool>(map.get(k));
+      });
+    };
+
+    std::println("{:>6.3f} {:>12.1f} {:>12.1f} {:>12.1f} {:>12.1f}", load, run(old_map, hits), run(new_map, hits),
+                 run(old_map, misses), run(new_map, misses));
+  }
+  std::println("");
+}
+
+// Heap bytes behind a std::string: none while it fits the small string buffer, else its capacity plus malloc overhead
+static std::size_t heap_bytes(const std::string &s)
+{
+  return s.capacity() <= 15 ? 0 : (s.capacity() + 1 + 8 + 15) / 16 * 16;
+}
+
+void bench_slot_layout()
+{
+  constexpr std::size_t N = 1'000'000;
+  constexpr std::size_t CAP = 1 << 21;
+  constexpr std::size_t LOOKUPS = 2'000'000;
+
+  std::println("== Leaf_map slots: two std::strings vs packed handles + arena ({} entries) ==", N);
+  std::println("{:>10} {:>14} {:>14} {:>10} {:>10}", "key/value", "bytes/entry old", "bytes/entry new", "hit old", "hit new");
+
+  std::mt19937 rng(5);
+  for (auto [klen, vlen] : {std::pair<std::size_t, std::size_t>{8, 8}, {12, 24}, {24, 24}, {40, 100}, {100, 200}})
+  {
+    std::vector<std::string> keys(N);
+    for (std::size_t i = 0; i < N; ++i)
+    {
+      keys[i] = std::to_string(i) + ":";
+      keys[i].resize(klen, 'k');
+    }
+    std::string value(vlen, 'v');
+
+    Linear_leaf_map old_map(CAP);
+    Leaf_map new_map(CAP);
+    for (const auto &k : keys)
+    {
+      old_map.put(k, value);
+      new_map.put(k, value);
+    }
+
+    std::size_t old_bytes = old_map._store.size() * sizeof(Linear_leaf_map::bucket);
+    for (const auto &b : old_map._store) old_bytes += heap_bytes(b.key) + heap_bytes(b.value);
+
+    std::vector<std::string> probes(LOOKUPS / 4);
+    for (auto &p : probes) p = keys[rng() % N];
+    auto hit_old = ns_per_op(LOOKUPS, [&] {
+      for (std::size_t r = 0; r < 4; ++r)
+        for (const auto &k : probes) sink = sink + old_map.get(k)->size();
+    });
+    auto hit_new = ns_per_op(LOOKUPS, [&] {
+      for (std::size_t r = 0; r < 4; ++r)
+        for (const auto &k : probes) sink = sink + new_map.get(k)->bytes().size();
+    });
+
+    std::println("{:>6}/{:<3} {:>14.1f} {:>14.1f} {:>10.1f} {:>10.1f}", klen, vlen, double(old_bytes) / N,
+                 double(new_map.bytes()) / N, hit_old, hit_new);
+  }
+  std::println("");
+}
+
+void bench_grow_latency()
+{
+  constexpr std::size_t N = 4'000'000;
+
+  std::println("== Put latency while growing from empty to {} entries (ns) ==", N);
+  std::println("{:>20} {:>10} {:>10} {:>10} {:>12}", "map", "p50", "p99.9", "p99.99", "max");
+
+  std::vector<std::string> keys(N);
+  for (std::size_t i = 0; i < N; ++i) keys[i] = "k" + std::to_string(i);
+
+  auto run = [&](const char *name, auto &&put) {
+    std::vector<double> lat(N);
+    for (std::size_t i = 0; i < N; ++i)
+    {
+      auto start = bench_clock::now();
+      put(keys[i]);
+      lat[i] = std::chrono::duration<double, std::nano>(bench_clock::now() - start).count();
+    }
+    std::sort(lat.begin(), lat.end());
+    std::println("{:>20} {:>10.0f} {:>10.0f} {:>10.0f} {:>12.0f}", name, lat[N / 2], lat[N - N / 1000],
+                 lat[N - N / 10000], lat.back());
+  };
+
+  {
+    Leaf_map map;
+    run("Leaf_map", [&](const std::string &k) { map.put(k, "value"); });
+  }
+  {
+    std::unordered_map<std::string, std::string> map;
+    run("std::unordered_map", [&](const std::string &k) { map[k] = "value"; });
+  }
+  std::println("");
+}
+
+void bench_counter()
+{
+  constexpr std::size_t KEYS = 100'000;
+  constexpr std::size_t OPS = 4'000'000;
+
+  std::println("== Counter update: get + parse + format + put vs incr ({} counters, ns/op) ==", KEYS);
+
+  std::vector<std::string> keys(KEYS);
+  for (std::size_t i = 0; i < KEYS; ++i) keys[i] = "rate:" + std::to_string(i);
+  std::mt19937 rng(3);
+  std::vector<uint32_t> order(OPS);
+  for (auto &o : order) o = rng() % KEYS;
+
+  Leaf_map text_map, typed_map;
+  double text = ns_per_op(OPS, [&] {
+    for (auto o : order)
+    {
+      auto v = text_map.get(keys[o]);
+      int64_t n = v ? std::stoll(v->to_string()) : 0;
+      text_map.put(keys[o], Leaf_value(std::string_view(std::to_string(n + 1))));
+    }
+  });
+  double typed = ns_per_op(OPS, [&] {
+    for (auto o : order) typed_map.incr(keys[o], Leaf_value(int64_t{1}));
+  });
+
+  std::println("{:>20} {:>10.1f}", "get/parse/put", text);
+  std::println("{:>20} {:>10.1f}", "incr", typed);
+  std::println("");
+}
+
+void bench_child_index()
+{
+  std::println("== Child index: sorted vector vs Child_index (ns/op) ==");
+  std::println("{:>9} {:>12} {:>12} {:>12} {:>12}", "fan-out", "insert old", "insert new", "lookup old", "lookup new");
+
+  std::mt19937 rng(42);
+  int dummy = 0;
+  constexpr std::size_t LOOKUPS = 2'000'000;
+
+  for (std::size_t fanout : {1, 4, 8, 16, 64, 256, 1024, 10'000, 100'000, 1'000'000})
+  {
+    // Interned IDs of siblings are scattered, a component may have been interned anywhere
+    std::vector<uint32_t> ids(fanout);
+    std::iota(ids.begin(), ids.end(), 1);
+    std::shuffle(ids.begin(), ids.end(), rng);
+    std::vector<uint32_t> probes(LOOKUPS);
+    for (auto &p : probes) p = ids[rng() % fanout];
+
+    // Quadratic inserts get too slow to measure past 100k children
+    bool run_old = fanout <= 100'000;
+    Sorted_children old_index;
+    double insert_old = run_old ? ns_per_op(fanout, [&] { for (auto id : ids) old_index.insert(id, &dummy); }) : 0;
+
+    Child_index<int> new_index;
+    double insert_new = ns_per_op(fanout, [&] { for (auto id : ids) new_index.insert(id, &dummy); });
+
+    double lookup_old = run_old ? ns_per_op(LOOKUPS, [&] { for (auto id : probes) sink = sink + reinterpret_cast<uintptr_t>(old_index.find(id)); }) : 0;
+    double lookup_new = ns_per_op(LOOKUPS, [&] { for (auto id : probes) sink = sink + reinterpret_cast<uintptr_t>(new_index.find(id)); });
+
+    if (run_old)
+      std::println("{:>9} {:>12.1f} {:>12.1f} {:>12.1f} {:>12.1f}", fanout, insert_old, insert_new, lookup_old, lookup_new);
+    else
+      std::println("{:>9} {:>12} {:>12.1f} {:>12} {:>12.1f}", fanout, "-", insert_new, "-", lookup_new);
+  }
+  std::println("");
+}
+
+int main()
+{
+  bench_child_index();
+  bench_hash();
+  bench_leaf_probe();
+  bench_slot_layout();
+  bench_grow_latency();
+  bench_counter();
+  return 0;
+}
@@ -1,38 +1,126 @@
 #include "./src/server.hpp"
+#include "./src/wal.hpp"
 
+#include <cctype>
 #include <csignal>
 #include <cstdint>
 #include <exception>
+#include <malloc.h>
+#include <memory>
+#include <stdexcept>
 #include <print>
 #include <string>
+#include <tuple>
 
 void handle_sigchld(int) { while (waitpid(-1, nullptr, WNOHANG) > 0); }
 
 int print_usage(std::string prog)
 {
   std::string s = "Usage : "
-                  "   " + prog + "\n"
-                  " or\n"
-                  "   " + prog + "<port>\n";
+                  "   " + prog + " [port] [--threads <n>] [--maxmemory <bytes>[k|m|g]] [--wal <file>]\n"
+                  "        [--fsync always|everysec|never|<ms>] [--snapshot <file>] [--save-every <seconds>]\n"
+                  "   port defaults to " + std::to_string(PORT) + ", threads to 1, no memory limit, no log,\n"
+                  "   fsync to everysec, no snapshot, saves only on the save command\n";
   std::println("{}", s);
   return 1;
 }
 
+// "512", "64k", "100mb", "2G"
+std::size_t parse_bytes(std::string s)
+{
+  std::size_t pos = 0;
+  std::size_t n = std::stoull(s, &pos);
+  std::string unit = s.substr(pos);
+  for (auto &c : unit) c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+  if (unit.empty() || unit == "b")
+    return n;
+  if (unit == "k" || unit == "kb")
+    return n << 10;
+  if (unit == "m" || unit == "mb")
+    return n << 20;
+  if (unit == "g" || unit == "gb")
+    return n << 30;
+  throw std::invalid_argument("unknown unit: " + unit);
+}
+
+// "always", "everysec", "never", or milliseconds between syncs
+std::pair<Fsync_policy, unsigned> parse_fsync(const std::string &s)
+{
+  if (s == "always")
+    return {Fsync_policy::ALWAYS, 0};
+  if (s == "everysec")
+    return {Fsync_policy::INTERVAL, 1000};
+  if (s == "never")
+    return {Fsync_policy::NEVER, 0};
+
+  unsigned long ms = std::stoul(s);
+  if (ms == 0)
+    throw std::invalid_argument("fsync interval must be positive");
+  return {Fsync_policy::INTERVAL, static_cast<unsigned>(ms)};
+}
+
 int main(int argc, char * argv[])
 {
-  uint16_t port = 0;
-  if (argc == 2)
+  Server_options opts{};
+  std::string wal_path;
+  std::string snapshot_path;
+  unsigned save_every = 0;
+  auto [fsync, fsync_ms] = parse_fsync("everysec");
+  for (int i = 1; i < argc; ++i)
   {
+    std::string arg = argv[i];
     try
-    { port = std::stoi(argv[1]); }
+    {
+      if (arg == "--threads" && i + 1 < argc)
+        opts.threads = std::stoul(argv[++i]);
+      else if (arg == "--maxmemory" && i + 1 < argc)
+        opts.max_memory = parse_bytes(argv[++i]);
+      else if (arg == "--wal" && i + 1 < argc)
+        wal_path = argv[++i];
+      else if (arg == "--fsync" && i + 1 < argc)
+        std::tie(fsync, fsync_ms) = parse_fsync(argv[++i]);
+      else if (arg == "--snapshot" && i + 1 < argc)
+        snapshot_path = argv[++i];
+      else if (arg == "--save-every" && i + 1 < argc)
+        save_every = std::stoul(argv[++i]);
+      else
+        opts.port = std::stoi(arg);
+    }
     catch(std::exception & e)
     { return print_usage(argv[0]); }
   }
-  else port = PORT;
+  if (opts.threads == 0 || (save_every && snapshot_path.empty()))
+    return print_usage(argv[0]);
 
   std::signal(SIGCHLD, handle_sigchld);
 
-  int skt = init_server(port, HOST);
+  // No glibc fastbins: with them, the first large free after a teardown of millions of small objects coalesces all of
+  // them in one go, stalling the event loop for tens of milliseconds. Thread caches still serve hot small sizes.
+  mallopt(M_MXFAST, 0);
+
+  std::unique_ptr<Wal> wal;
+  if (!wal_path.empty())
+  {
+    auto opened = Wal::open(wal_path, fsync, fsync_ms);
+    if (!opened)
+    {
+      std::println("{}", opened.error());
+      return 1;
+    }
+    wal = std::move(*opened);
+    set_wal(wal.get());
+  }
+  if (!snapshot_path.empty())
+    set_snapshot(snapshot_path, save_every);
+
+  if (opts.threads > 1)
+  {
+    run_reactors(opts);
+    return 0;
+  }
+
+  set_shard_max_memory(opts.max_memory);
+  int skt = init_server(opts.port, opts.host);
   run_server(skt);
 
   close(skt);
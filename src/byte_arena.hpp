@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+/**
+ * @brief Append-only byte storage addressed by 64-bit references.
+ *
+ * Bytes go into chunks that start small and double up to `CHUNK_MAX`, and strings too big to share a chunk get
+ * one of their own, so appending never moves bytes already stored and a reference stays valid for the arena's
+ * lifetime. Nothing is freed individually: owners count what they abandon and rebuild into a fresh arena.
+ * Not thread-safe.
+ */
+class Byte_arena
+{
+  static constexpr std::size_t CHUNK_MIN = 256;
+  static constexpr std::size_t CHUNK_MAX = 64 * 1024;
+
+  struct chunk
+  {
+    std::unique_ptr<char[]> data;
+    std::size_t capacity;
+  };
+
+  std::vector<chunk> _chunks;
+  std::size_t _current = 0; ///< Chunk being filled
+  std::size_t _used = 0;    ///< Bytes used in the current chunk
+  std::size_t _size = 0;    ///< Bytes appended in total
+  std::size_t _bytes = 0;   ///< Bytes held by all chunks
+
+public:
+  /**
+   * @brief Copy `s` into the arena.
+   *
+   * @return Reference to pass to data()
+   */
+  uint64_t append(std::string_view s)
+  {
+    _size += s.size();
+
+    if (s.size() > CHUNK_MAX / 4)
+    {
+      // Large strings get a chunk of their own and leave the current chunk to keep filling
+      add_chunk(s.size());
+      std::memcpy(_chunks.back().data.get(), s.data(), s.size());
+      return ref(_chunks.size() - 1, 0);
+    }
+
+    if (_chunks.empty() || _used + s.size() > _chunks[_current].capacity)
+    {
+      std::size_t cap = _chunks.empty() ? CHUNK_MIN : std::min(_chunks[_current].capacity * 2, CHUNK_MAX);
+      add_chunk(std::max(cap, s.size()));
+      _current = _chunks.size() - 1;
+      _used = 0;
+    }
+
+    std::memcpy(_chunks[_current].data.get() + _used, s.data(), s.size());
+    uint64_t r = ref(_current, _used);
+    _used += s.size();
+    return r;
+  }
+
+  char *data(uint64_t ref) { return _chunks[ref >> 32].data.get() + (ref & 0xffffffff); }
+  const char *data(uint64_t ref) const { return _chunks[ref >> 32].data.get() + (ref & 0xffffffff); }
+
+  /// Bytes appended so far, live or not
+  std::size_t size() const { return _size; }
+
+  /// Bytes held by the arena's chunks
+  std::size_t bytes() const { return _bytes; }
+
+private:
+  static uint64_t ref(std::size_t chunk, std::size_t offset) { return (uint64_t(chunk) << 32) | offset; }
+
+  void add_chunk(std::size_t capacity)
+  {
+    _chunks.push_back({std::make_unique_for_overwrite<char[]>(capacity), capacity});
+    _bytes += capacity;
+  }
+};
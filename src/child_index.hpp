@@ -0,0 +1,259 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/**
+ * @brief Maps interned component IDs to child pointers, adapting its layout to the fan-out.
+ *
+ * Small fan-out: IDs are packed into a dense uint32_t array that is scanned linearly, 4 (SSE2) or 8 (AVX2) IDs per
+ * compare, with the children in a parallel array. Past `SMALL_MAX` children the same two arrays become an
+ * open-addressed table (linear probing, load <= 1/2, backward-shift erase), so lookups stay O(1) for nodes with
+ * millions of children and inserts never shift the whole array. The table shrinks once erases leave it under 1/8
+ * full, so a node that lost most of its children does not keep its largest table. ID 0 is reserved as the empty
+ * marker.
+ *
+ * Iteration order is unspecified. Not thread-safe.
+ *
+ * @tparam T Child type, stored by pointer
+ */
+template <typename T>
+class Child_index
+{
+public:
+  using id_type = uint32_t;
+
+  static constexpr std::size_t SMALL_MAX = 8;  ///< Switch to the table past this many children
+  static constexpr std::size_t SMALL_MIN = 4;  ///< Switch back to the flat array below this many
+
+private:
+  std::vector<id_type> _ids;  ///< Flat: first _size entries. Table: all slots, 0 = empty
+  std::vector<T *> _children; ///< Parallel to _ids
+  std::size_t _size = 0;
+  uint8_t _bits = 0;          ///< log2 of table capacity, 0 while flat
+
+public:
+  /**
+   * @brief Lookup child by ID. Returns nullptr if absent.
+   */
+  T *find(id_type id) const
+  {
+    if (_bits == 0)
+    {
+      std::size_t i = scan(id);
+      return i < _size ? _children[i] : nullptr;
+    }
+
+    std::size_t mask = _ids.size() - 1;
+    for (std::size_t i = slot_of(id);; i = (i + 1) & mask)
+    {
+      if (_ids[i] == id)
+        return _children[i];
+      if (_ids[i] == 0)
+        return nullptr;
+    }
+  }
+
+  /**
+   * @brief Insert a child. Returns false, leaving the index untouched, if the ID is already present.
+   */
+  bool insert(id_type id, T *child)
+  {
+    if (_bits == 0)
+    {
+      if (scan(id) < _size)
+        return false;
+      if (_size < SMALL_MAX)
+      {
+        _ids.push_back(id);
+        _children.push_back(child);
+        ++_size;
+        return true;
+      }
+      rebuild(table_bits_for(_size + 1));
+    }
+    else if (find(id) != nullptr)
+      return false;
+    else if ((_size + 1) * 2 > _ids.size())
+      rebuild(_bits + 1);
+
+    place(id, child);
+    ++_size;
+    return true;
+  }
+
+  /**
+   * @brief Erase a child. Returns the removed pointer, or nullptr if the ID was absent.
+   */
+  T *erase(id_type id)
+  {
+    if (_bits == 0)
+    {
+      std::size_t i = scan(id);
+      if (i >= _size)
+        return nullptr;
+      T *child = _children[i];
+      // Order does not matter, fill the hole with the last entry
+      _ids[i] = _ids.back();
+      _children[i] = _children.back();
+      _ids.pop_back();
+      _children.pop_back();
+      --_size;
+      return child;
+    }
+
+    std::size_t mask = _ids.size() - 1;
+    std::size_t hole = slot_of(id);
+    for (;; hole = (hole + 1) & mask)
+    {
+      if (_ids[hole] == 0)
+        return nullptr;
+      if (_ids[hole] == id)
+        break;
+    }
+
+    T *child = _children[hole];
+    // Backward shift: pull later entries of the cluster into the hole if the hole lies on their probe path
+    for (std::size_t i = (hole + 1) & mask; _ids[i] != 0; i = (i + 1) & mask)
+    {
+      std::size_t ideal = slot_of(_ids[i]);
+      if (((i - ideal) & mask) >= ((i - hole) & mask))
+      {
+        _ids[hole] = _ids[i];
+        _children[hole] = _children[i];
+        hole = i;
+      }
+    }
+    _ids[hole] = 0;
+    _children[hole] = nullptr;
+    --_size;
+
+    if (_size < SMALL_MIN)
+      rebuild(0);
+    else if (_size * 8 < _ids.size() && _bits > table_bits_for(_size))
+      rebuild(table_bits_for(_size));
+    return child;
+  }
+
+  std::size_t size() const { return _size; }
+  bool empty() const { return _size == 0; }
+
+  /// Bytes held outside the object itself
+  std::size_t bytes() const { return _ids.capacity() * sizeof(id_type) + _children.capacity() * sizeof(T *); }
+
+  /**
+   * @brief Iterator over `{id, child}` pairs.
+   */
+  struct iterator
+  {
+    const Child_index *_index;
+    std::size_t _idx;
+
+    iterator(const Child_index *index, std::size_t i) : _index(index), _idx(i) { skip(); }
+
+    void skip()
+    {
+      while (_idx < _index->_ids.size() && _index->_ids[_idx] == 0) ++_idx;
+    }
+
+    iterator &operator++()
+    {
+      ++_idx;
+      skip();
+      return *this;
+    }
+
+    bool operator!=(const iterator &o) const { return _idx != o._idx; }
+
+    std::pair<id_type, T *> operator*() const { return {_index->_ids[_idx], _index->_children[_idx]}; }
+  };
+
+  iterator begin() const { return iterator(this, 0); }
+  iterator end() const { return iterator(this, _ids.size()); }
+
+private:
+  // Position of `id` in the flat array, or _size if absent
+  std::size_t scan(id_type id) const
+  {
+    const id_type *ids = _ids.data();
+    std::size_t i = 0;
+#if defined(__AVX2__)
+    const __m256i needle8 = _mm256_set1_epi32(static_cast<int>(id));
+    for (; i + 8 <= _size; i += 8)
+    {
+      __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(ids + i));
+      if (int m = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, needle8))))
+        return i + __builtin_ctz(m);
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i needle = _mm_set1_epi32(static_cast<int>(id));
+    for (; i + 4 <= _size; i += 4)
+    {
+      __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ids + i));
+      if (int m = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, needle))))
+        return i + __builtin_ctz(m);
+    }
+#endif
+    for (; i < _size; ++i)
+      if (ids[i] == id)
+        return i;
+    return _size;
+  }
+
+  std::size_t slot_of(id_type id) const
+  {
+    // Fibonacci hashing, interned IDs are small and dense so the high product bits spread them well
+    return static_cast<std::size_t>((uint64_t(id) * 0x9E3779B97F4A7C15ull) >> (64 - _bits));
+  }
+
+  static uint8_t table_bits_for(std::size_t n)
+  {
+    uint8_t bits = 4;
+    while ((std::size_t{1} << bits) < n * 2) ++bits;
+    return bits;
+  }
+
+  // Linear probe for a free slot, the ID is known to be absent
+  void place(id_type id, T *child)
+  {
+    std::size_t mask = _ids.size() - 1;
+    std::size_t i = slot_of(id);
+    while (_ids[i] != 0) i = (i + 1) & mask;
+    _ids[i] = id;
+    _children[i] = child;
+  }
+
+  // Re-lays the entries out flat (bits == 0) or as a table of 2^bits slots
+  void rebuild(uint8_t bits)
+  {
+    std::vector<id_type> ids;
+    std::vector<T *> children;
+    ids.swap(_ids);
+    children.swap(_children);
+
+    _bits = bits;
+    if (bits == 0)
+    {
+      for (std::size_t i = 0; i < ids.size(); ++i)
+        if (ids[i] != 0)
+        {
+          _ids.push_back(ids[i]);
+          _children.push_back(children[i]);
+        }
+      return;
+    }
+
+    _ids.assign(std::size_t{1} << bits, 0);
+    _children.assign(std::size_t{1} << bits, nullptr);
+    for (std::size_t i = 0; i < ids.size(); ++i)
+      if (ids[i] != 0)
+        place(ids[i], children[i]);
+  }
+};
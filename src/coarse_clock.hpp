@@ -0,0 +1,37 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+/**
+ * @brief Wall clock read once per event loop iteration, cheap enough to consult on every lookup.
+ *
+ * Each thread keeps its own reading: reactors refresh it with update() when epoll_wait returns, everything on that
+ * thread sees the same instant until the next refresh. Expiry deadlines are whole Unix seconds, 0 means none.
+ */
+namespace coarse_clock
+{
+  inline thread_local uint64_t NOW_MS = 0;
+
+  /// Longest TTL accepted, keeps deadlines well inside uint32_t
+  inline constexpr uint32_t TTL_MAX = 1u << 30;
+
+  inline void update()
+  {
+    auto since_epoch = std::chrono::system_clock::now().time_since_epoch();
+    NOW_MS = std::chrono::duration_cast<std::chrono::milliseconds>(since_epoch).count();
+  }
+
+  inline uint32_t seconds() { return static_cast<uint32_t>(NOW_MS / 1000); }
+
+  /// Milliseconds left until the next whole second
+  inline int until_next_second() { return static_cast<int>(1000 - NOW_MS % 1000); }
+
+  /**
+   * @brief Deadline for a TTL of `ttl` seconds from now. Rounded up, so an entry lives at least `ttl` seconds and
+   * at most one second more.
+   */
+  inline uint32_t deadline(uint32_t ttl) { return static_cast<uint32_t>((NOW_MS + uint64_t(ttl) * 1000 + 999) / 1000); }
+
+  inline bool expired(uint32_t deadline) { return deadline != 0 && deadline <= seconds(); }
+}
@@ -6,6 +6,7 @@
 #include <optional>
 #include <string>
 #include <ranges>
+#include <utility>
 #include <vector>
 #include <cstdint>
 
@@ -13,183 +14,568 @@
 
 #include "assert.hpp"
 
-struct Node;
-// Returns index where first id >= desired Id exists.
-inline NodeID lower_bound(const std::vector<std::pair<uint64_t, Node *>> &nodes, NodeID id)
-{
-  auto it = std::ranges::lower_bound(nodes, id, {}, [](const auto &pair) { return pair.first; });
-  return static_cast<NodeID>(it - nodes.begin());
-}
-
 NodeID Node::insert(Node *node)
 {
   __assert(node != nullptr, "Node has to exist");
 
-  NodeID id = string_intern::string_to_key(node->_path);
-  node->_id = id;
-  std::size_t lb = lower_bound(_nodes, id);
-  if (lb < _nodes.size() && _nodes[lb].first == id)
-    return _nodes[lb].first;
-
-  _nodes.insert(_nodes.begin() + lb, {id, node});
-  return id;
+  _nodes.insert(node->_id, node);
+  return node->_id;
 }
 
-Node * Node::create_child_node(const std::string &path)
+Node * Node::create_child_node(Node_pool &pool, std::string_view path)
 {
-  NodeID id = string_intern::string_to_key(path);
-  std::size_t lb = lower_bound(_nodes, id);
-  if (lb < _nodes.size() && _nodes[lb].first == id)
-    return _nodes[lb].second;
+  if (auto found = search(path))
+    return *found;
 
-  // Doing heap allocation only if necessary, that's why searching earler.
-  Node *node = new Node(this, path);
-  node->_id = id;
-  _nodes.insert(_nodes.begin() + lb, {id, node});
+  // Allocating only if necessary, that's why searching earler. The node takes its own intern reference.
+  Node *node = create_node(pool, this, path);
+  _nodes.insert(node->_id, node);
   return node;
 }
 
-std::optional<Node *> Node::search(const std::string &path)
+std::optional<Node *> Node::search(std::string_view path)
 {
-  NodeID id = string_intern::string_to_key(path);
+  NodeID id = string_intern::find_key(path);
+  if (id == 0)
+    return std::nullopt;  // Never interned, so no node can have it
 
-  std::size_t lb = lower_bound(_nodes, id);
-  if (lb < _nodes.size() && _nodes[lb].first == id)
-    return _nodes[lb].second;
-  else
-    return std::nullopt;
+  if (Node *child = _nodes.find(id))
+    return child;
+  return std::nullopt;
 }
 
-Node * Node::delete_child_node(const std::string &path)
+Node * Node::delete_child_node(std::string_view path)
 {
-  NodeID id = string_intern::string_to_key(path);
+  NodeID id = string_intern::find_key(path);
+  if (id == 0)
+    return nullptr;
 
-  std::size_t lb = lower_bound(_nodes, id);
-  if (lb < _nodes.size() && _nodes[lb].first == id)
-  {
-    Node *child = _nodes[lb].second;
-    _nodes.erase(_nodes.begin() + lb);
-    return child;
-  }
-  return nullptr;  // not found
+  return _nodes.erase(id);  // nullptr if not found
 }
 
 
-std::optional<Node *> Tree::find(const std::string &path) const
+std::optional<Node *> Tree::find(std::string_view path) const
 {
-  std::vector<std::string> comps = split_path_view(path);
   Node *current = this->_root;
 
-  for (const auto &c : comps)
-    if (auto found = current->search(c); found.has_value())
+  for (auto c = next_component(path); !c.empty(); c = next_component(path))
+    if (auto found = current->search(c); found.has_value() && !(*found)->expired())
       current = found.value();
     else
       return std::nullopt;
   return current;
 }
 
-Node * Tree::insert(const std::string &path)
+Node * Tree::insert(std::string_view path)
 {
-  std::vector<std::string> comps = split_path_view(path);
+  evict();
   Node *current = this->_root;
 
-  for (const auto &c : comps)
-    if (auto found = current->search(c); found)
+  for (auto c = next_component(path); !c.empty(); c = next_component(path))
+  {
+    auto found = current->search(c);
+    if (found && (*found)->expired())
+    {
+      // Expired subtrees are gone as far as clients can tell, start over with an empty node
+      bury(track(current, [&] { return current->delete_child_node(c); }));
+      found = std::nullopt;
+    }
+    if (found)
+    {
       current = *found;
-    else
-      current = current->create_child_node(c);
+      continue;
+    }
+
+    Node *parent = current;
+    current = track(parent, [&] { return parent->create_child_node(_pool, c); });
+    current->_saved = _epoch;  // A save already running leaves it out
+    _heap += current->bytes();
+    link(current);
+  }
   return current;
 }
 
-bool Tree::remove(const std::string &path)
+void Tree::link(Node *node)
 {
-  auto components = split_path_view(path);
-  if (components.empty())
-    return false;
+  node->_ring_next = _hand;
+  node->_ring_prev = _hand->_ring_prev;
+  _hand->_ring_prev->_ring_next = node;
+  _hand->_ring_prev = node;
+}
+
+void Tree::evict()
+{
+  std::size_t budget = EVICT_SCAN;
+  while (_max_bytes != 0 && bytes() > _max_bytes && budget > 0)
+  {
+    Node *node = _hand;
+    if (node->_image_id != Image::NONE)
+    {
+      // Entries still in the image take no memory of ours, the kernel pages them out on its own
+      _hand = node->_ring_next;
+      --budget;
+      continue;
+    }
+    preserve(node);
+    auto [visited, erased] = track(node, [&] { return node->_leaves.evict(budget); });
+    _evicted += erased;
+    if (visited < budget)
+      _hand = node->_ring_next;  // Swept this node to the end
+    budget -= std::min(budget, std::max<std::size_t>(visited, 1));
+  }
+}
 
+bool Tree::remove(std::string_view path)
+{
+  Node *to_delete = unlink(path, false);
+  if (to_delete)
+    bury(to_delete);
+  return to_delete != nullptr;
+}
+
+Node *Tree::unlink(std::string_view path, bool only_expired)
+{
   // Find parent of the node to remove
-  std::string_view leaf = components.back();
-  components.pop_back();
+  size_t end = path.find_last_not_of('/');
+  if (end == std::string_view::npos)
+    return nullptr;
+  path = path.substr(0, end + 1);
 
-  auto parent = find(join_path(components));
+  size_t slash = path.rfind('/');
+  std::string_view leaf = slash == std::string_view::npos ? path : path.substr(slash + 1);
+  std::string_view parent_path = slash == std::string_view::npos ? std::string_view{} : path.substr(0, slash);
+
+  auto parent = find(parent_path);
   if (!parent)
-    return false;
+    return nullptr;
 
-  Node *to_delete = (*parent)->delete_child_node(leaf.data());
-  if (to_delete)
+  // Clients cannot see an expired node, only the reaper may take one
+  if (auto child = (*parent)->search(leaf); !child || (*child)->expired() != only_expired)
+    return nullptr;
+  return track(*parent, [&] { return (*parent)->delete_child_node(leaf); });
+}
+
+bool Tree::collect(std::size_t budget)
+{
+  // Depth first through the graveyard itself, so deep trees cannot overflow the stack and a million-node subtree goes
+  // a slice per call
+  while (budget > 0 && !_graveyard.empty())
+  {
+    auto [n, next] = _graveyard.back();
+    auto it = Child_index<Node>::iterator(&n->_nodes, next);
+    if (it != n->_nodes.end())
+    {
+      // Children are queued a slice at a time too, a node with a million of them must not stall one call either
+      std::size_t parent = _graveyard.size() - 1;
+      for (; budget > 0 && it != n->_nodes.end(); ++it, --budget) _graveyard.push_back({(*it).second});
+      _graveyard[parent].next = it._idx;
+      continue;
+    }
+
+    // Every child is gone, the index still points at them but is never read again
+    _graveyard.pop_back();
+    --budget;
+
+    _heap -= n->bytes();
+    step_past(n);
+    if (n->_image_id != Image::NONE)
+      release_image(n);
+    if (_hand == n)
+      _hand = n->_ring_next;
+    n->_ring_prev->_ring_next = n->_ring_next;
+    n->_ring_next->_ring_prev = n->_ring_prev;
+    _pool.destroy(n);
+  }
+  return !_graveyard.empty();
+}
+
+void Tree::bury(Node *node)
+{
+  // The save may have written the root and not yet its descendants, so while it runs the whole subtree waits for it
+  if (_save)
+  {
+    std::vector<std::string_view> path;
+    resolve(node->_parent, path);
+    _held.emplace(node, std::vector<std::string>(path.begin(), path.end()));
+  }
+  else
+    _graveyard.push_back({node});
+  node->_parent = nullptr;
+}
+
+void Tree::begin_save(Snapshot_writer &out)
+{
+  __assert(_save == nullptr, "A save is already running");
+  _save = &out;
+  ++_epoch;
+  _save_cursor = _root;
+  _save_node = nullptr;
+  _save_open = false;
+}
+
+bool Tree::save(std::size_t budget)
+{
+  while (_save && budget > 0)
+  {
+    if (_save_node)
+    {
+      write_leaves(_save_node, _save_pos, budget);
+      if (_save_pos == SIZE_MAX)
+      {
+        _save_node->_saved = _epoch;
+        _save_node = nullptr;
+      }
+      continue;
+    }
+
+    if (!_save_cursor)
+    {
+      // Every node is out, what was held for the save can go now
+      _save->seal();
+      _save = nullptr;
+      for (auto &[node, prefix] : _held) _graveyard.push_back({const_cast<Node *>(node)});
+      _held.clear();
+      break;
+    }
+
+    Node *n = _save_cursor;
+    _save_cursor = n->_ring_next == _root ? nullptr : n->_ring_next;
+    --budget;
+    if (!pending(n))
+      continue;
+    if (!resolve(n, _save_path))
+    {
+      n->_saved = _epoch;
+      continue;
+    }
+    _save->node(_save_path, n->_expiry);
+    _save_node = n;
+    _save_pos = 0;
+    _save_open = true;
+  }
+  return _save != nullptr;
+}
+
+void Tree::freeze(Node *node)
+{
+  std::size_t budget = SIZE_MAX;
+  if (node == _save_node)
+  {
+    write_leaves(node, _save_pos, budget);
+    _save_node = nullptr;
+  }
+  else if (resolve(node, _save_path))
+  {
+    _save->node(_save_path, node->_expiry);
+    std::size_t pos = 0;
+    write_leaves(node, pos, budget);
+    _save_open = false;  // The writer's open record is this node's now
+  }
+  node->_saved = _epoch;
+}
+
+void Tree::write_leaves(Node *node, std::size_t &pos, std::size_t &budget)
+{
+  if (node == _save_node && !_save_open)
+  {
+    // Another node was written in between, carry on in a record of its own
+    resolve(node, _save_path);
+    _save->node(_save_path, node->_expiry);
+    _save_open = true;
+  }
+  auto leaf = [&](std::string_view k, const Leaf_value &v, uint32_t expiry) { _save->leaf(k, v, expiry); };
+  if (node->_image_id != Image::NONE)
+    pos = _image->scan(node->_image_id, pos, budget, leaf);
+  else
+    pos = node->_leaves.scan(pos, budget, leaf);
+}
+
+std::vector<std::pair<std::string, uint32_t>> Tree::mount(std::shared_ptr<const Image> image,
+                                                          const std::function<bool(std::string_view)> &keep)
+{
+  __assert(!_image && _root->_nodes.empty(), "Mounting onto a tree that is not empty");
+
+  // Parents come before children in the image, so each node's parent is built, or skipped, by the time it is reached
+  std::vector<Node *> built(image->node_count(), nullptr);
+  std::vector<std::pair<std::string, uint32_t>> deadlines;
+  for (uint32_t n = 0; n < image->node_count(); ++n)
+  {
+    const Image_node &in = image->node(n);
+    Node *node = _root;
+    if (n != 0)
+    {
+      Node *parent = built[in.parent];
+      std::string_view name = image->name(n);
+      if (!parent || (parent == _root && !keep(name)))
+        continue;
+      node = track(parent, [&] { return parent->create_child_node(_pool, name); });
+      _heap += node->bytes();
+      link(node);
+      node->_expiry = in.deadline;
+      if (in.deadline)
+      {
+        resolve(node, _save_path);
+        std::string path;
+        for (auto c : _save_path) path.append("/").append(c);
+        deadlines.emplace_back(std::move(path), in.deadline);
+      }
+    }
+    built[n] = node;
+
+    if (in.leaf_count != 0 && (n != 0 || keep({})))
+    {
+      node->_image_id = n;
+      ++_image_nodes;
+    }
+  }
+  if (_image_nodes)
+    _image = std::move(image);
+  return deadlines;
+}
+
+void Tree::thaw(Node *node)
+{
+  preserve(node);
+  if (node->_image_id == Image::NONE)
+    return;
+
+  track(node, [&] {
+    node->_leaves.reserve(_image->node(node->_image_id).leaf_count);
+    std::size_t budget = SIZE_MAX;
+    _image->scan(node->_image_id, 0, budget, [&](std::string_view k, const Leaf_value &v, uint32_t expiry) {
+      node->_leaves.put(k, v, expiry);
+    });
+    return 0;
+  });
+  release_image(node);
+}
+
+void Tree::release_image(Node *node)
+{
+  node->_image_id = Image::NONE;
+  if (--_image_nodes == 0)
+    _image.reset();
+}
+
+bool Tree::resolve(const Node *node, std::vector<std::string_view> &path) const
+{
+  path.clear();
+  for (; node != _root; node = node->_parent)
   {
-    delete to_delete;
-    return true;
+    path.push_back(node->_path);
+    if (node->_parent)
+      continue;
+
+    // Top of an unlinked subtree: part of the save only if it was removed while the save ran
+    auto it = _held.find(node);
+    if (it == _held.end())
+      return false;
+    path.insert(path.end(), it->second.rbegin(), it->second.rend());
+    break;
   }
-  return false;
+  std::ranges::reverse(path);
+  return true;
 }
 
-std::expected<std::string *, std::string> Tree::set(const std::string &path, const std::string &key, const std::string &val)
+void Tree::step_past(Node *node)
+{
+  if (_save_cursor == node)
+    _save_cursor = node->_ring_next == _root ? nullptr : node->_ring_next;
+  if (_save_node == node)
+    _save_node = nullptr;
+}
+
+std::expected<Leaf_value, std::string> Tree::set(std::string_view path, std::string_view key, std::string_view val,
+                                             uint32_t expiry)
 {
   auto node = this->find(path);
   if (!node.has_value())
     return std::unexpected<std::string>(
         std::format("Couldn't set value: {} at key: {} because no node at path: {} exists", val, key, path));
 
-  return node.value()->_leaves.put(key, val);
+  evict();
+  thaw(*node);
+  auto v = track(*node, [&] { return node.value()->_leaves.put(key, val, expiry); });
+  if (!v)
+    return std::unexpected<std::string>(std::format("Couldn't set value at key: {} & path: {} because {}", key, path, v.error()));
+
+  return *v;
 }
 
-[[nodiscard("Use it immediately or copy it, pointer may become invalid after next operation on map or map deletion")]]
-std::expected<std::string *, std::string> Tree::get(const std::string &path, const std::string &key)
+std::expected<Leaf_value, std::string> Tree::set(std::string_view path, std::string_view key, const Leaf_value &val,
+                                             uint32_t expiry)
+{
+  auto node = this->find(path);
+  if (!node.has_value())
+    return std::unexpected<std::string>(
+        std::format("Couldn't set value: {} at key: {} because no node at path: {} exists", val.to_string(), key, path));
+
+  evict();
+  thaw(*node);
+  auto v = track(*node, [&] { return node.value()->_leaves.put(key, val, expiry); });
+  if (!v)
+    return std::unexpected<std::string>(std::format("Couldn't set value at key: {} & path: {} because {}", key, path, v.error()));
+
+  return *v;
+}
+
+[[nodiscard("Use it immediately or copy it, the view may become invalid after next operation on map or map deletion")]]
+std::expected<Leaf_value, std::string> Tree::get(std::string_view path, std::string_view key)
 {
   auto node = this->find(path);
   if (!node)
     return std::unexpected<std::string>(std::format("Couldn't get value at key: {} because no node at path: {} exists", key, path));
 
-  auto v = node.value()->_leaves.get(key);
-  if (v == nullptr)
+  // A lookup may drop an expired entry, unless the node is still to be saved: the save walks its slots in place
+  std::optional<Leaf_value> v;
+  if ((*node)->_image_id != Image::NONE)
+  {
+    if (auto found = _image->find((*node)->_image_id, key))
+      v = found->first;
+  }
+  else if (pending(*node))
+    v = std::as_const((*node)->_leaves).get(key);
+  else
+    v = track(*node, [&] { return node.value()->_leaves.get(key); });
+  if (!v)
     return std::unexpected<std::string>(
         std::format("Couldn't get value at key: {} & path: {} because key itself doesn't exist", key, path));
 
-  return v;
+  return *v;
 }
 
-std::string Tree::print() const
+std::expected<void, std::string> Tree::erase(std::string_view path, std::string_view key)
 {
-  std::string s{};
-  print_recursive(_root, 0, s);
-  return s;
+  auto node = this->find(path);
+  if (!node)
+    return std::unexpected<std::string>(std::format("Couldn't delete key: {} because no node at path: {} exists", key, path));
+
+  // Only a hit is worth copying the node out of the image for
+  if ((*node)->_image_id != Image::NONE && !_image->find((*node)->_image_id, key))
+    return std::unexpected<std::string>(
+        std::format("Couldn't delete key: {} & path: {} because key itself doesn't exist", key, path));
+  thaw(*node);
+  if (!track(*node, [&] { return (*node)->_leaves.erase(key); }))
+    return std::unexpected<std::string>(
+        std::format("Couldn't delete key: {} & path: {} because key itself doesn't exist", key, path));
+  return {};
 }
 
-void Tree::print_recursive(Node *root, int indent, std::string &out) const
+std::expected<Leaf_value, std::string> Tree::incr(std::string_view path, std::string_view key, const Leaf_value &delta)
 {
-  out += std::string(indent, ' ') + root->_path + "\n";
+  auto node = this->find(path);
+  if (!node)
+    return std::unexpected<std::string>(std::format("Couldn't increment key: {} because no node at path: {} exists", key, path));
 
-  if (!root->_leaves.empty())
-    for (const auto &[k, v] : root->_leaves) out += std::string(indent + 1, ' ') + root->_path + " : " + k + " -> " + v + "\n";
-  for (const auto &[id, child] : root->_nodes) print_recursive(child, indent + 2, out);
+  evict();
+  thaw(*node);
+  auto v = track(*node, [&] { return node.value()->_leaves.incr(key, delta); });
+  if (!v)
+    return std::unexpected<std::string>(std::format("Couldn't increment key: {} & path: {} because {}", key, path, v.error()));
+
+  return *v;
 }
 
-std::vector<std::string> Tree::split_path_view(const std::string &path) const
+std::expected<uint32_t, std::string> Tree::deadline(std::string_view path, std::string_view key) const
 {
-  using namespace std::literals;
+  auto node = this->find(path);
+  if (!node)
+    return std::unexpected<std::string>(std::format("Couldn't get deadline of key: {} because no node at path: {} exists", key, path));
 
-  if (path.empty())
-    return {};
+  std::optional<uint32_t> d;
+  if ((*node)->_image_id != Image::NONE)
+  {
+    if (auto found = _image->find((*node)->_image_id, key))
+      d = found->second;
+  }
+  else
+    d = node.value()->_leaves.deadline(key);
+  if (!d)
+    return std::unexpected<std::string>(
+        std::format("Couldn't get deadline of key: {} & path: {} because key itself doesn't exist", key, path));
+  return *d;
+}
 
-  auto components = path | std::views::split('/') |
-                    std::views::transform([](auto &&range) { return std::string(range.begin(), range.end()); }) |
-                    std::views::filter([](const std::string &sv) { return !sv.empty(); });
+std::expected<void, std::string> Tree::expire(std::string_view path, uint32_t expiry)
+{
+  auto node = this->find(path);
+  if (!node)
+    return std::unexpected<std::string>(std::format("Couldn't set expiry because no node at path: {} exists", path));
+  if (*node == _root)
+    return std::unexpected<std::string>("Couldn't set expiry on the root node");
 
-  return {components.begin(), components.end()};
+  preserve(*node);
+  (*node)->_expiry = expiry;
+  return {};
 }
 
-std::string Tree::join_path(const std::vector<std::string> &components) const
+bool Tree::reap(std::string_view path, std::string_view key)
 {
-  if (components.empty())
-    return "";
+  if (key.empty())
+  {
+    Node *expired = unlink(path, true);
+    if (expired)
+      bury(expired);
+    return expired != nullptr;
+  }
 
-  std::string result;
-  for (size_t i = 0; i < components.size(); ++i)
+  auto node = this->find(path);
+  if (!node)
+    return false;
+  // Still served from the image, which hides the expired entry already. Thawing would copy the whole node out for it.
+  if ((*node)->_image_id != Image::NONE)
+    return false;
+  preserve(*node);
+  return track(*node, [&] { return (*node)->_leaves.erase_expired(key); });
+}
+
+std::expected<Leaf_map_stats, std::string> Tree::stats(std::string_view path) const
+{
+  auto node = this->find(path);
+  if (!node)
+    return std::unexpected<std::string>(std::format("Couldn't get stats because no node at path: {} exists", path));
+
+  if ((*node)->_image_id != Image::NONE)
+    return _image->stats((*node)->_image_id);
+  return node.value()->_leaves.stats();
+}
+
+std::string Tree::print() const
+{
+  std::string s{};
+  print_recursive(_root, 0, s);
+  return s;
+}
+
+void Tree::print_recursive(Node *root, int indent, std::string &out) const
+{
+  out += std::string(indent, ' ') + root->_path + "\n";
+
+  if (!root->_leaves.empty())
+    for (auto [k, v] : root->_leaves) out += std::format("{}{} : {} -> {}\n", std::string(indent + 1, ' '), root->_path, k, v.to_string());
+  if (root->_image_id != Image::NONE)
   {
-    if (i != 0)
-      result += '/';
-    result += components[i].data();
+    std::size_t budget = SIZE_MAX;
+    _image->scan(root->_image_id, 0, budget, [&](std::string_view k, const Leaf_value &v, uint32_t) {
+      out += std::format("{}{} : {} -> {}\n", std::string(indent + 1, ' '), root->_path, k, v.to_string());
+    });
   }
-  return result;
+  for (auto [id, child] : root->_nodes)
+    if (!child->expired())
+      print_recursive(child, indent + 2, out);
+}
+
+std::string_view Tree::next_component(std::string_view &path)
+{
+  size_t begin = path.find_first_not_of('/');
+  if (begin == std::string_view::npos)
+  {
+    path = {};
+    return {};
+  }
+
+  size_t end = path.find('/', begin);
+  std::string_view component = path.substr(begin, end == std::string_view::npos ? end : end - begin);
+  path.remove_prefix(end == std::string_view::npos ? path.size() : end);
+  return component;
 }
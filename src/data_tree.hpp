@@ -5,14 +5,22 @@
 #include <cstddef>
 #include <cstdint>
 #include <expected>
+#include <functional>
+#include <memory>
 #include <optional>
 #include <string>
+#include <string_view>
 #include <ranges>
 #include <vector>
 #include <cstdint>
 #include <unordered_map>
 
+#include "child_index.hpp"
+#include "coarse_clock.hpp"
+#include "image.hpp"
 #include "leaf_map.hpp"
+#include "object_pool.hpp"
+#include "snapshot.hpp"
 #include "assert.hpp"
 
 using Tag = uint8_t;
@@ -23,96 +31,331 @@ inline constexpr Tag TAG_LEAF = 4; // 0100
 
 using NodeID = std::uint32_t;
 
+// Transparent hash so string tables can be probed with a std::string_view without building a std::string
+struct string_hash
+{
+  using is_transparent = void;
+  std::size_t operator()(std::string_view s) const noexcept { return std::hash<std::string_view>{}(s); }
+};
+
 // Using RAM addresses as hash
+// Tables are per thread: every reactor owns its own Tree shard, and IDs are only ever compared within one Tree.
+// Every live Node holds one reference on its component's ID. When the last one goes the string is dropped and its ID
+// is recycled, so churn over short-lived paths (sessions/<uuid>) keeps the tables flat. IDs of live nodes never change.
 class string_intern
 {
-  static inline std::vector<std::string> _paths;
-  static inline std::unordered_map<std::string, NodeID> _str_to_id;
+  static inline thread_local std::vector<std::string> _paths;
+  static inline thread_local std::vector<uint32_t> _refs;     ///< _refs[id - 1], 0 means the ID is free
+  static inline thread_local std::vector<NodeID> _free_ids;
+  static inline thread_local std::unordered_map<std::string, NodeID, string_hash, std::equal_to<>> _str_to_id;
 public:
-  // Interns a string and returns its unique ID (1-based)
+  // Interns a string, takes a reference on it and returns its unique ID (1-based)
   [[nodiscard]]
-  static NodeID string_to_key(const std::string &path)
+  static NodeID acquire(std::string_view path)
   {
     auto it = _str_to_id.find(path);
     if (it != _str_to_id.end())
+    {
+      ++_refs[it->second - 1];
       return it->second;
+    }
 
-    _paths.emplace_back(path);
-    NodeID id = _paths.size();  // 1-based
-    _str_to_id[path] = id;
+    NodeID id;
+    if (!_free_ids.empty())
+    {
+      id = _free_ids.back();
+      _free_ids.pop_back();
+      _paths[id - 1] = path;
+    }
+    else
+    {
+      _paths.emplace_back(path);
+      _refs.push_back(0);
+      id = _paths.size();  // 1-based
+    }
+    _refs[id - 1] = 1;
+    _str_to_id.emplace(_paths[id - 1], id);
     return id;
   }
 
+  // Drops a reference taken by acquire(), the string is forgotten and its ID reused once nothing refers to it
+  static void release(NodeID id)
+  {
+    __assert(id != 0 && id <= _refs.size() && _refs[id - 1] != 0, "Releasing an ID that is not interned");
+    if (--_refs[id - 1] != 0)
+      return;
+
+    _str_to_id.erase(_paths[id - 1]);
+    std::string{}.swap(_paths[id - 1]);
+    _free_ids.push_back(id);
+  }
+
+  // Looks a string up without interning it, returns 0 if it was never interned. Lookups of missing paths go through
+  // here so they stay pure reads and cannot grow the tables.
+  [[nodiscard]]
+  static NodeID find_key(std::string_view path)
+  {
+    auto it = _str_to_id.find(path);
+    return it != _str_to_id.end() ? it->second : 0;
+  }
+
   // Resolve an ID back to the original string
   [[nodiscard]]
   static std::optional<std::string_view> key_to_string(NodeID id)
   {
-    if (id == 0 || id > _paths.size())
+    if (id == 0 || id > _paths.size() || _refs[id - 1] == 0)
       return std::nullopt;
     return std::string_view(_paths[id - 1]);
   }
+
+  // Number of live interned strings
+  static std::size_t size() { return _str_to_id.size(); }
 };
 
+struct Node;
+
+// Nodes of a Tree live in slabs owned by that Tree
+using Node_pool = Object_pool<Node>;
+
 struct Node
 {
-  Tag        _tag;
+  // Path walks only touch the child index, so it comes first
+  Child_index<Node> _nodes;
+  NodeID      _id;
+  uint32_t    _expiry = 0; // Unix second the node and its subtree expire at, 0 = never
+  Tag         _tag = TAG_NODE;
+  uint32_t    _saved = 0;  // Tree::_epoch of the last snapshot that has this node, or that it is too new for
+  uint32_t    _image_id = Image::NONE; // Node of the tree's image still holding the entries, NONE once in _leaves
   Node *      _parent = nullptr;
   std::string _path;
-  NodeID      _id;
-  std::vector<std::pair<uint64_t, Node*>> _nodes;
   Leaf_map _leaves;
+  Node *      _ring_prev = this; // All nodes of a tree form a ring, walked by the eviction hand
+  Node *      _ring_next = this;
 
-  Node(Node * parent, const std::string& path)
-    : _parent(parent), _path(path), _id(string_intern::string_to_key(path)), _nodes({})
+  Node(Node * parent, std::string_view path)
+    : _nodes(), _id(string_intern::acquire(path)), _parent(parent), _path(path)
   {}
 
-  ~Node()
-  {
-    for (auto n : _nodes) delete n.second;
-  }
+  // Children are not owned here, Tree::collect() tears subtrees down
+  ~Node() { string_intern::release(_id); }
+
+  Node(const Node &) = delete;
+  Node &operator=(const Node &) = delete;
 
   NodeID insert(Node * node);
 
-  static Node * create_node(Node * parent, const std::string& path)
+  static Node * create_node(Node_pool &pool, Node * parent, std::string_view path)
   {
     __assert(parent != nullptr, "Node has to exist");
 
-    Node *node = new Node(parent, path);
+    Node *node = pool.create(parent, path);
     return node;
   }
 
-  Node * create_child_node(const std::string& path);
+  Node * create_child_node(Node_pool &pool, std::string_view path);
+
+  std::optional<Node *> search(std::string_view path);
 
-  std::optional<Node *> search(const std::string& path);
+  Node* delete_child_node(std::string_view path);
 
-  Node* delete_child_node(const std::string& path);
+  bool expired() const { return coarse_clock::expired(_expiry); }
+
+  // Bytes held outside the node object: path past the small string buffer, child index and leaves
+  std::size_t bytes() const
+  {
+    return (_path.capacity() > 15 ? _path.capacity() + 1 : 0) + _nodes.bytes() + _leaves.bytes();
+  }
 };
 
 class Tree
 {
+  Node_pool _pool;
   Node * _root;
+  Node * _hand;                  // Node the eviction sweep is in
+  std::size_t _heap = 0;         // Node::bytes() summed over all nodes
+  std::size_t _max_bytes = 0;    // 0 = no limit
+  std::size_t _evicted = 0;
+  // Removed subtrees waiting for collect(): each root, and the children queued below it so far. `next` is the
+  // child index slot to carry on queuing from.
+  struct Grave
+  {
+    Node *node;
+    std::size_t next = 0;
+  };
+  std::vector<Grave> _graveyard;
+
+  // Snapshot in progress, see begin_save(). A node whose _saved is not _epoch yet is written out before anything
+  // changes it, so the snapshot shows every node as it was when the save began.
+  Snapshot_writer *_save = nullptr;
+  uint32_t _epoch = 0;
+  Node *_save_cursor = nullptr;   // Next node of the ring to save, nullptr once the ring is done
+  Node *_save_node = nullptr;     // Node whose leaves are being written, from slot _save_pos on
+  std::size_t _save_pos = 0;
+  bool _save_open = false;        // The writer's open record is _save_node's
+  std::vector<std::string_view> _save_path;
+  // Subtrees removed while saving, by root, with the path of the parent they hung from. They are kept out of the
+  // graveyard until the save is done.
+  std::unordered_map<const Node *, std::vector<std::string>> _held;
+
+  // Image the tree was mounted from, kept while some node still serves its entries from it
+  std::shared_ptr<const Image> _image;
+  std::size_t _image_nodes = 0;
 
 public:
-  Tree(const std::string& parth = "/") : _root(new Node(nullptr, "/"))
-  { _root->_tag = TAG_ROOT; }
-  ~Tree() { delete _root; }
+  // Slots the eviction sweep may visit per write
+  static constexpr std::size_t EVICT_SCAN = 256;
+
+  Tree(const std::string& parth = "/") : _root(_pool.create(nullptr, "/")), _hand(_root)
+  {
+    _root->_tag = TAG_ROOT;
+    _heap = _root->bytes();
+  }
+  ~Tree()
+  {
+    for (auto &[node, prefix] : _held) _graveyard.push_back({const_cast<Node *>(node)});
+    _graveyard.push_back({_root});
+    collect(SIZE_MAX);
+  }
+
+  Tree(const Tree &) = delete;
+  Tree &operator=(const Tree &) = delete;
+
+  // Nodes past their deadline, and everything under them, are not found. insert() replaces them with fresh nodes.
+  std::optional<Node *> find(std::string_view path) const;
+  Node *insert(std::string_view path);
+
+  // Unlinks the subtree at `path` at once and leaves it to collect() to destroy
+  bool remove(std::string_view path);
 
-  std::optional<Node *> find(const std::string& path) const;
-  Node *insert(const std::string &path);
+  /// Removes `key` from the leaves at `path`
+  std::expected<void, std::string> erase(std::string_view path, std::string_view key);
 
-  bool remove(const std::string &path);
+  /// Destroys removed subtrees, spending at most `budget` units (a node queued or destroyed). Returns true if some are
+  /// left for a later call.
+  bool collect(std::size_t budget);
 
-  std::expected<std::string *, std::string> set(const std::string& path, const std::string& key, const std::string& val);
+  /// True while removed subtrees are waiting for collect()
+  bool has_garbage() const { return !_graveyard.empty(); }
 
-  [[nodiscard("Use it immediately or copy it, pointer may become invalid after next operation on map or map deletion")]]
-  std::expected<std::string*, std::string> get(const std::string& path, const std::string& key);
+  /// `expiry` is the Unix second the entry expires at, 0 for never
+  std::expected<Leaf_value, std::string> set(std::string_view path, std::string_view key, std::string_view val,
+                                             uint32_t expiry = 0);
+
+  /// Stores `val` with its type as it is, see Leaf_value::encode() for what the string overload stores
+  std::expected<Leaf_value, std::string> set(std::string_view path, std::string_view key, const Leaf_value &val,
+                                             uint32_t expiry = 0);
+
+  [[nodiscard("Use it immediately or copy it, the view may become invalid after next operation on map or map deletion")]]
+  std::expected<Leaf_value, std::string> get(std::string_view path, std::string_view key);
+
+  /// Adds `delta` to the number at `key` in place, a missing key counts as 0
+  std::expected<Leaf_value, std::string> incr(std::string_view path, std::string_view key, const Leaf_value &delta);
+
+  /// Deadline of the entry at `path`, `key`, 0 if it has none
+  std::expected<uint32_t, std::string> deadline(std::string_view path, std::string_view key) const;
+
+  /// Expires the node at `path`, its leaves and its whole subtree at Unix second `expiry`, 0 to keep it forever
+  std::expected<void, std::string> expire(std::string_view path, uint32_t expiry);
+
+  /// Removes the entry at `path`, `key`, or the node at `path` if `key` is empty, if its deadline has passed. An entry
+  /// of a node still served from the image stays there, where lookups already skip it.
+  bool reap(std::string_view path, std::string_view key);
+
+  /// Probe-length and sizing counters of the leaves at `path`, of the image's index while they are still in it
+  std::expected<Leaf_map_stats, std::string> stats(std::string_view path) const;
 
   std::string print() const;
 
+  /// Number of live nodes, root included
+  std::size_t node_count() const { return _pool.live(); }
+
+  /// Bytes held by the tree: node slabs plus everything the nodes point to
+  std::size_t bytes() const { return _pool.bytes() + _heap; }
+
+  /// While the tree holds more than `max` bytes, each write first evicts entries nobody touched recently. 0 for no limit.
+  void set_max_bytes(std::size_t max) { _max_bytes = max; }
+  std::size_t max_bytes() const { return _max_bytes; }
+
+  /// Entries evicted so far
+  std::size_t evicted() const { return _evicted; }
+
+  /// Starts a snapshot of the tree as it is now into `out`. save() writes it a slice at a time.
+  void begin_save(Snapshot_writer &out);
+
+  /// Writes more of the snapshot, spending at most `budget` units (a node visited or a slot looked at). Returns true
+  /// while some is left for a later call, the writer is sealed once it is done.
+  bool save(std::size_t budget);
+
+  /// True while a snapshot is being written
+  bool saving() const { return _save != nullptr; }
+
+  /**
+   * @brief Fills a tree that is still empty with the nodes of `image` whose top-level component passes `keep`, the
+   * root's own entries with `keep("")`. Only the nodes are built: entries are read from the image until the first
+   * change to their node copies them into its leaf map.
+   *
+   * @return Paths and deadlines of the nodes that have one
+   */
+  std::vector<std::pair<std::string, uint32_t>> mount(std::shared_ptr<const Image> image,
+                                                      const std::function<bool(std::string_view)> &keep);
+
+  /// Nodes whose entries are still read from the image
+  std::size_t image_nodes() const { return _image_nodes; }
+
 private:
-  void print_recursive(Node *root, int indent, std::string &out) const;
+  // Runs `fn`, which may change `node`, and keeps the byte count in step
+  template <typename F>
+  auto track(Node *node, F &&fn)
+  {
+    std::size_t before = node->bytes();
+    auto result = fn();
+    _heap += node->bytes() - before;
+    return result;
+  }
+
+  // CLOCK sweep over the leaves of every node, visiting at most EVICT_SCAN slots, while the tree is over its limit
+  void evict();
+
+  // Adds a new node to the ring just behind the hand, so it is swept last
+  void link(Node *node);
+
+  // Hands a subtree unlinked from the tree to collect(), or holds it until the running save is done
+  void bury(Node *node);
+
+  // True while the running save still has to write `node`
+  bool pending(const Node *node) const { return _save && node->_saved != _epoch; }
+
+  // Copy on write: writes `node` out as it is, if the running save has not yet, before the caller changes it
+  void preserve(Node *node)
+  {
+    if (pending(node))
+      freeze(node);
+  }
+  void freeze(Node *node);
 
-  std::vector<std::string> split_path_view(const std::string &path) const;
+  // Copies the entries of `node` out of the image into its leaf map, before the caller changes them
+  void thaw(Node *node);
+
+  // `node` no longer reads from the image, which goes once no node does
+  void release_image(Node *node);
+
+  // Writes the leaves of `node` from slot `pos` on, until `budget` runs out
+  void write_leaves(Node *node, std::size_t &pos, std::size_t &budget);
+
+  // Fills `path` with the components of `node` from the root down. False if the node was removed before the running
+  // save began, and so is no part of it.
+  bool resolve(const Node *node, std::vector<std::string_view> &path) const;
+
+  // Moves the save on past `node`, which is about to be destroyed
+  void step_past(Node *node);
+
+  // Unlinks the node at `path` from its parent and returns it, or nullptr if there is none. With `only_expired` a node
+  // that has not expired is left alone, without it an expired one is.
+  Node *unlink(std::string_view path, bool only_expired);
+
+
+  void print_recursive(Node *root, int indent, std::string &out) const;
 
-  std::string join_path(const std::vector<std::string> &components) const;
+  // Splits the next non-empty '/' separated component off the front of `path`, empty once the path is exhausted.
+  static std::string_view next_component(std::string_view &path);
 };
@@ -0,0 +1,360 @@
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <format>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "image.hpp"
+#include "snapshot.hpp"
+
+#include "assert.hpp"
+
+namespace
+{
+  uint64_t checksum(const char *p, size_t n) { return Wyhash{}(std::string_view(p, n)); }
+
+  // Slot of `key` in an index of 2^bits slots
+  size_t home(std::string_view key, uint32_t bits) { return Wyhash{}(key) & ((size_t{1} << bits) - 1); }
+
+  size_t align8(size_t n) { return (n + 7) & ~size_t{7}; }
+
+  struct Build_leaf
+  {
+    std::string_view key;
+    Leaf_value value;
+    uint32_t deadline;
+  };
+
+  struct Build_node
+  {
+    std::string_view name;
+    uint32_t parent;
+    uint32_t deadline = 0;
+    std::vector<uint32_t> children;
+    std::vector<Build_leaf> leaves;
+  };
+
+  // Buffers output and writes it to `fd` a megabyte at a time
+  struct Writer
+  {
+    int fd;
+    std::string buf;
+    bool ok = true;
+
+    void flush()
+    {
+      std::string_view data = buf;
+      while (ok && !data.empty())
+      {
+        ssize_t n = ::write(fd, data.data(), data.size());
+        if (n == -1 && errno == EINTR)
+          continue;
+        ok = n > 0;
+        if (ok)
+          data.remove_prefix(n);
+      }
+      buf.clear();
+    }
+
+    void append(const void *p, size_t n)
+    {
+      buf.append(static_cast<const char *>(p), n);
+      if (buf.size() >= (1 << 20))
+        flush();
+    }
+
+    void pad(size_t to)
+    {
+      static constexpr char zeros[8] = {};
+      append(zeros, to % 8 ? 8 - to % 8 : 0);
+    }
+  };
+}
+
+std::expected<std::shared_ptr<const Image>, std::string> Image::open(const std::string &path)
+{
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return std::unexpected(std::format("Couldn't open image {}: {}", path, std::strerror(errno)));
+  struct stat st{};
+  if (fstat(fd, &st) == -1)
+  {
+    ::close(fd);
+    return std::unexpected(std::format("Couldn't stat image {}: {}", path, std::strerror(errno)));
+  }
+
+  std::shared_ptr<Image> image(new Image());
+  image->_path = path;
+  image->_size = st.st_size;
+  if (image->_size < sizeof(Image_header))
+  {
+    ::close(fd);
+    return std::unexpected(std::format("{} is not an image", path));
+  }
+  void *p = mmap(nullptr, image->_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (p == MAP_FAILED)
+    return std::unexpected(std::format("Couldn't map image {}: {}", path, std::strerror(errno)));
+  image->_data = static_cast<const char *>(p);
+  image->_header = reinterpret_cast<const Image_header *>(p);
+  // Lookups land anywhere in the file
+  madvise(p, image->_size, MADV_RANDOM);
+
+  const Image_header &h = *image->_header;
+  auto corrupt = [&] { return std::unexpected(std::format("Image {} is corrupt", path)); };
+  if (std::string_view(h.magic, sizeof(h.magic)) != IMAGE_MAGIC)
+    return std::unexpected(std::format("{} is not an image", path));
+
+  size_t size = image->_size;
+  size_t nodes_end = sizeof(Image_header) + size_t{h.node_count} * sizeof(Image_node);
+  if (h.node_count == 0 || nodes_end > size || h.leaves_off < nodes_end || h.leaves_off % 8 ||
+      h.leaf_count > (size - h.leaves_off) / sizeof(Image_leaf) || h.slots_off % 8 || h.slots_off > size ||
+      h.slot_count > (size - h.slots_off) / sizeof(uint32_t) || h.strings_off > size ||
+      h.strings_size > size - h.strings_off)
+    return corrupt();
+  size_t covered = offsetof(Image_header, checksum) + sizeof(h.checksum);
+  if (checksum(image->_data + covered, nodes_end - covered) != h.checksum)
+    return corrupt();
+
+  // Everything open() hands out about nodes is checked here once, entries are checked as they are read
+  for (uint32_t n = 0; n < h.node_count; ++n)
+  {
+    const Image_node &in = image->node(n);
+    if ((n == 0) != (in.parent == NONE) || (n != 0 && in.parent >= n) || in.name_off > h.strings_size ||
+        in.name_len > h.strings_size - in.name_off || in.first_leaf > h.leaf_count ||
+        in.leaf_count > h.leaf_count - in.first_leaf || in.slot_bits >= 32 ||
+        (in.leaf_count != 0 && in.leaf_count >= (uint64_t{1} << in.slot_bits)) || in.first_slot > h.slot_count ||
+        (in.leaf_count != 0 && (uint64_t{1} << in.slot_bits) > h.slot_count - in.first_slot))
+      return corrupt();
+  }
+  return image;
+}
+
+Image::~Image()
+{
+  if (_data)
+    munmap(const_cast<char *>(_data), _size);
+}
+
+std::string_view Image::string(uint64_t off, uint32_t len) const
+{
+  __assert(off <= _header->strings_size && len <= _header->strings_size - off, std::format("Image {} is corrupt", _path));
+  return {_data + _header->strings_off + off, len};
+}
+
+Leaf_value Image::value(const Image_leaf &l) const
+{
+  switch (static_cast<Leaf_value::Type>(l.type))
+  {
+    case Leaf_value::Type::INT: return Leaf_value(std::bit_cast<int64_t>(l.value));
+    case Leaf_value::Type::DOUBLE: return Leaf_value(std::bit_cast<double>(l.value));
+    default: return Leaf_value(string(l.value, l.value_len));
+  }
+}
+
+std::optional<std::pair<Leaf_value, uint32_t>> Image::find(uint32_t n, std::string_view k) const
+{
+  const Image_node &in = node(n);
+  if (in.leaf_count == 0)
+    return std::nullopt;
+
+  size_t mask = (size_t{1} << in.slot_bits) - 1;
+  const uint32_t *index = slots() + in.first_slot;
+  // At least one slot is empty, so the probe ends
+  for (size_t i = home(k, in.slot_bits); index[i] != 0; i = (i + 1) & mask)
+  {
+    __assert(index[i] <= in.leaf_count, std::format("Image {} is corrupt", _path));
+    const Image_leaf &l = leaves()[in.first_leaf + index[i] - 1];
+    if (key(l) != k)
+      continue;
+    if (coarse_clock::expired(l.deadline))
+      return std::nullopt;
+    return std::pair{value(l), l.deadline};
+  }
+  return std::nullopt;
+}
+
+Leaf_map_stats Image::stats(uint32_t n) const
+{
+  const Image_node &in = node(n);
+  Leaf_map_stats st{in.leaf_count, 0, 0, 0, 0, 0, 0};
+  if (in.leaf_count == 0)
+    return st;
+
+  size_t mask = (size_t{1} << in.slot_bits) - 1, inspected = 0;
+  const uint32_t *index = slots() + in.first_slot;
+  for (size_t i = 0; i <= mask; ++i)
+  {
+    if (index[i] == 0)
+      continue;
+    __assert(index[i] <= in.leaf_count, std::format("Image {} is corrupt", _path));
+    size_t probe = ((i - home(key(leaves()[in.first_leaf + index[i] - 1]), in.slot_bits)) & mask) + 1;
+    st.max_probe = std::max(st.max_probe, probe);
+    inspected += probe;
+  }
+  st.capacity = mask + 1;
+  st.load_factor = double(st.size) / st.capacity;
+  st.avg_probe = double(inspected) / st.size;
+  return st;
+}
+
+std::expected<void, std::string> write_image(std::string_view snapshot, const std::string &path)
+{
+  if (!snapshot.starts_with(SNAPSHOT_MAGIC))
+    return std::unexpected("Not a snapshot");
+
+  // Gather every node record by path. Views point into `snapshot`, which outlives all of this.
+  std::vector<Build_node> nodes(1, Build_node{{}, Image::NONE});
+  std::unordered_map<std::string, uint32_t> by_path{{"", 0}};
+  std::string path_key;
+  Build_node *current = nullptr;
+  auto on_node = [&](std::span<const std::string_view> components, uint32_t deadline) {
+    uint32_t n = 0;
+    path_key.clear();
+    for (auto c : components)
+    {
+      path_key.append("/").append(c);
+      auto [it, added] = by_path.try_emplace(path_key, static_cast<uint32_t>(nodes.size()));
+      if (added)
+      {
+        nodes[n].children.push_back(it->second);
+        nodes.push_back(Build_node{c, n});
+      }
+      n = it->second;
+    }
+    current = &nodes[n];
+    current->deadline = deadline;
+  };
+  auto on_leaf = [&](std::string_view key, const Leaf_value &value, uint32_t deadline) {
+    current->leaves.push_back({key, value, deadline});
+  };
+  for (size_t pos = SNAPSHOT_MAGIC.size(); pos < snapshot.size();)
+  {
+    auto body = next_block(snapshot, pos);
+    if (!body || !decode_block(*body, on_node, on_leaf))
+      return std::unexpected(std::format("Snapshot is corrupt at byte {}", pos));
+  }
+  if (nodes.size() >= Image::NONE)
+    return std::unexpected("Too many nodes for an image");
+
+  // Parents before children: breadth first from the root, numbering nodes in the order they are written
+  std::vector<uint32_t> order{0};
+  std::vector<uint32_t> number(nodes.size());
+  for (size_t i = 0; i < order.size(); ++i)
+  {
+    number[order[i]] = static_cast<uint32_t>(i);
+    for (uint32_t c : nodes[order[i]].children) order.push_back(c);
+  }
+
+  // Index every node's entries, a key seen again replaces the earlier one. Names come first in the string table,
+  // entries after them.
+  std::vector<uint32_t> slots;
+  std::vector<Image_node> table(nodes.size());
+  uint64_t leaf_count = 0, strings = 0, leaf_strings = 0;
+  for (size_t i = 0; i < order.size(); ++i)
+  {
+    Build_node &b = nodes[order[i]];
+    uint32_t bits = 0;
+    while (b.leaves.size() && (size_t{1} << bits) < b.leaves.size() * 2) ++bits;
+    size_t first_slot = slots.size();
+    if (!b.leaves.empty())
+      slots.resize(first_slot + (size_t{1} << bits));
+
+    size_t kept = 0;
+    for (auto &l : b.leaves)
+    {
+      size_t mask = (size_t{1} << bits) - 1, s = home(l.key, bits);
+      for (; slots[first_slot + s] != 0 && b.leaves[slots[first_slot + s] - 1].key != l.key; s = (s + 1) & mask);
+      if (slots[first_slot + s] != 0)
+      {
+        b.leaves[slots[first_slot + s] - 1] = l;
+        continue;
+      }
+      b.leaves[kept] = l;
+      slots[first_slot + s] = static_cast<uint32_t>(++kept);
+    }
+    b.leaves.erase(b.leaves.begin() + kept, b.leaves.end());
+    for (auto &l : b.leaves)
+      leaf_strings += l.key.size() + (l.value.type() == Leaf_value::Type::BYTES ? l.value.bytes().size() : 0);
+
+    table[i] = Image_node{strings, static_cast<uint32_t>(b.name.size()),
+                          i == 0 ? Image::NONE : number[b.parent], leaf_count, static_cast<uint32_t>(kept),
+                          b.deadline, kept ? first_slot : 0, kept ? bits : 0, 0};
+    strings += b.name.size();
+    leaf_count += kept;
+  }
+
+  Image_header h{};
+  std::memcpy(h.magic, IMAGE_MAGIC.data(), sizeof(h.magic));
+  h.node_count = static_cast<uint32_t>(table.size());
+  h.leaf_count = leaf_count;
+  h.slot_count = slots.size();
+  h.leaves_off = sizeof(Image_header) + table.size() * sizeof(Image_node);
+  h.slots_off = h.leaves_off + leaf_count * sizeof(Image_leaf);
+  h.strings_off = align8(h.slots_off + slots.size() * sizeof(uint32_t));
+  h.strings_size = strings + leaf_strings;
+
+  std::string front(reinterpret_cast<const char *>(&h), sizeof(h));
+  front.append(reinterpret_cast<const char *>(table.data()), table.size() * sizeof(Image_node));
+  size_t covered = offsetof(Image_header, checksum) + sizeof(h.checksum);
+  h.checksum = checksum(front.data() + covered, front.size() - covered);
+  std::memcpy(front.data() + offsetof(Image_header, checksum), &h.checksum, sizeof(h.checksum));
+
+  std::string tmp = path + ".tmp";
+  int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1)
+    return std::unexpected(std::format("Couldn't create {}: {}", tmp, std::strerror(errno)));
+  Writer out{fd};
+  out.append(front.data(), front.size());
+
+  // Entries in the order of the node table, their strings in the same order after the names
+  for (uint32_t n : order)
+    for (auto &l : nodes[n].leaves)
+    {
+      Image_leaf il{strings, static_cast<uint32_t>(l.key.size()), l.deadline, 0, 0,
+                    static_cast<uint8_t>(l.value.type()), {}};
+      strings += l.key.size();
+      switch (l.value.type())
+      {
+        case Leaf_value::Type::INT: il.value = std::bit_cast<uint64_t>(l.value.as_int()); break;
+        case Leaf_value::Type::DOUBLE: il.value = std::bit_cast<uint64_t>(l.value.as_double()); break;
+        default:
+          il.value = strings;
+          il.value_len = static_cast<uint32_t>(l.value.bytes().size());
+          strings += il.value_len;
+          break;
+      }
+      out.append(&il, sizeof(il));
+    }
+  out.append(slots.data(), slots.size() * sizeof(uint32_t));
+  out.pad(h.slots_off + slots.size() * sizeof(uint32_t));
+  for (uint32_t n : order) out.append(nodes[n].name.data(), nodes[n].name.size());
+  for (uint32_t n : order)
+    for (auto &l : nodes[n].leaves)
+    {
+      out.append(l.key.data(), l.key.size());
+      if (l.value.type() == Leaf_value::Type::BYTES)
+        out.append(l.value.bytes().data(), l.value.bytes().size());
+    }
+  out.flush();
+
+  bool ok = out.ok && fsync(fd) == 0;
+  int err = errno;
+  ::close(fd);
+  if (!ok || ::rename(tmp.c_str(), path.c_str()) == -1)
+  {
+    ::unlink(tmp.c_str());
+    return std::unexpected(std::format("Couldn't write image {}: {}", path, std::strerror(ok ? errno : err)));
+  }
+  return {};
+}
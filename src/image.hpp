@@ -0,0 +1,143 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <expected>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "coarse_clock.hpp"
+#include "leaf_map.hpp"
+
+/*
+ * Snapshot image, laid out to be served straight from an mmap of the file:
+ *
+ *      header  : "DASHIMG1" [u64 checksum] [u32 node_count][u32 0] [u64 leaf_count][u64 slot_count][u64 strings_size]
+ *                [u64 leaves_off][u64 slots_off][u64 strings_off]
+ *      nodes   : Image_node * node_count, parents before children, the root first
+ *      leaves  : Image_leaf * leaf_count, each node's entries in one run
+ *      slots   : u32 * slot_count, per node an open addressed index of its run, entry + 1 and 0 for empty
+ *      strings : names, keys and byte values
+ *
+ * Integers are little endian and every table starts 8-byte aligned. The checksum is the wyhash of the header past
+ * it and the node table, the part read at startup; entries are only read when looked up. Slots are probed linearly
+ * from the wyhash of the key, the same hash Leaf_map uses.
+ */
+
+inline constexpr std::string_view IMAGE_MAGIC = "DASHIMG1";
+
+struct Image_header
+{
+  char magic[8];
+  uint64_t checksum;
+  uint32_t node_count;
+  uint32_t reserved;
+  uint64_t leaf_count;
+  uint64_t slot_count;
+  uint64_t strings_size;
+  uint64_t leaves_off;
+  uint64_t slots_off;
+  uint64_t strings_off;
+};
+
+struct Image_node
+{
+  uint64_t name_off;
+  uint32_t name_len;
+  uint32_t parent;     ///< Image::NONE for the root
+  uint64_t first_leaf;
+  uint32_t leaf_count;
+  uint32_t deadline;
+  uint64_t first_slot;
+  uint32_t slot_bits;  ///< The index has 2^slot_bits slots, none if the node has no entries
+  uint32_t reserved;
+};
+
+struct Image_leaf
+{
+  uint64_t key_off;
+  uint32_t key_len;
+  uint32_t deadline;
+  uint64_t value;      ///< Offset of the bytes in the string table, or the number itself
+  uint32_t value_len;
+  uint8_t type;        ///< Leaf_value::Type
+  uint8_t reserved[3];
+};
+
+static_assert(sizeof(Image_header) == 72 && sizeof(Image_node) == 48 && sizeof(Image_leaf) == 32);
+
+/**
+ * @brief Read-only view of an image file mapped into memory.
+ *
+ * open() checks the header and the node table and nothing else, so opening costs the same for any number of entries;
+ * the kernel pages entries in as they are looked up. Values returned point into the mapping and stay valid as long as
+ * the Image does. Safe to share between threads.
+ */
+class Image
+{
+  const char *_data = nullptr;
+  std::size_t _size = 0;
+  const Image_header *_header = nullptr;
+  std::string _path;
+
+  Image() = default;
+
+public:
+  static constexpr uint32_t NONE = UINT32_MAX;
+
+  /// Maps the image at `path` and checks its header and node table
+  static std::expected<std::shared_ptr<const Image>, std::string> open(const std::string &path);
+
+  ~Image();
+
+  Image(const Image &) = delete;
+  Image &operator=(const Image &) = delete;
+
+  uint32_t node_count() const { return _header->node_count; }
+
+  const Image_node &node(uint32_t n) const { return nodes()[n]; }
+
+  std::string_view name(uint32_t n) const { return string(node(n).name_off, node(n).name_len); }
+
+  /// Live entry `key` of node `n` with its deadline, std::nullopt if it is missing or expired
+  std::optional<std::pair<Leaf_value, uint32_t>> find(uint32_t n, std::string_view key) const;
+
+  /// Probe-length and sizing counters of node `n`'s index, in the terms of Leaf_map::stats(). Holds no heap memory.
+  Leaf_map_stats stats(uint32_t n) const;
+
+  /**
+   * @brief Visit the live entries of node `n` from position `pos` on, calling `fn(key, value, deadline)`, taking one
+   * unit of `budget` per entry looked at. Same contract as Leaf_map::scan().
+   *
+   * @return Position to carry on from, or SIZE_MAX once every entry was looked at
+   */
+  template <typename F>
+  std::size_t scan(uint32_t n, std::size_t pos, std::size_t &budget, F &&fn) const
+  {
+    const Image_node &in = node(n);
+    for (; pos < in.leaf_count && budget > 0; ++pos, --budget)
+    {
+      const Image_leaf &l = leaves()[in.first_leaf + pos];
+      if (!coarse_clock::expired(l.deadline))
+        fn(key(l), value(l), l.deadline);
+    }
+    return pos < in.leaf_count ? pos : SIZE_MAX;
+  }
+
+private:
+  const Image_node *nodes() const { return reinterpret_cast<const Image_node *>(_data + sizeof(Image_header)); }
+  const Image_leaf *leaves() const { return reinterpret_cast<const Image_leaf *>(_data + _header->leaves_off); }
+  const uint32_t *slots() const { return reinterpret_cast<const uint32_t *>(_data + _header->slots_off); }
+
+  std::string_view string(uint64_t off, uint32_t len) const;
+  std::string_view key(const Image_leaf &l) const { return string(l.key_off, l.key_len); }
+  Leaf_value value(const Image_leaf &l) const;
+};
+
+/**
+ * @brief Lays the nodes and entries of a block snapshot (see snapshot.hpp) out as an image and writes it to `path`,
+ * synced. Records of the same node are merged, a key seen twice keeps its last value.
+ */
+std::expected<void, std::string> write_image(std::string_view snapshot, const std::string &path);
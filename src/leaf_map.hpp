@@ -1,178 +1,816 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 #include <vector>
 #include <optional>
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <expected>
 #include <cstring>
 #include <cassert>
 #include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <tuple>
+#include <type_traits>
 #include <utility>
 
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include <sys/mman.h>
+
+#include "byte_arena.hpp"
+#include "coarse_clock.hpp"
+#include "xxhash.hpp"
+
 /**
- * @brief Computes a 64-bit hash for a given string using a simplified Wyhash-style hash.
+ * @brief wyhash (final version 4) of a string, consuming 8/16 bytes per step and 48 per step on long keys.
  *
- * @param s Input string
- * @return 64-bit hash value
+ * Default hasher of Leaf_map.
  */
-static uint64_t wyhash_str(const std::string &s)
+struct Wyhash
 {
-  uint64_t hash = 0xa0761d6478bd642fULL ^ s.size();
-  for (char c : s)
-    hash = (hash ^ uint8_t(c)) * 0xe7037ed1a0b428dbULL;
-  hash ^= (hash >> 33);
-  return hash;
-}
+  uint64_t operator()(std::string_view s) const noexcept
+  {
+    const uint8_t *p = reinterpret_cast<const uint8_t *>(s.data());
+    size_t len = s.size();
+    uint64_t seed = mix(SECRET[0], SECRET[1]);
+    uint64_t a, b;
+
+    if (len <= 16)
+    {
+      if (len >= 4)
+      {
+        // Two possibly overlapping 4-byte reads from each end cover 4..16 bytes without a loop
+        a = (r4(p) << 32) | r4(p + ((len >> 3) << 2));
+        b = (r4(p + len - 4) << 32) | r4(p + len - 4 - ((len >> 3) << 2));
+      }
+      else if (len > 0)
+      {
+        a = (uint64_t(p[0]) << 16) | (uint64_t(p[len >> 1]) << 8) | p[len - 1];
+        b = 0;
+      }
+      else
+        a = b = 0;
+    }
+    else
+    {
+      size_t i = len;
+      if (i > 48)
+      {
+        // Three independent lanes keep the multipliers busy
+        uint64_t see1 = seed, see2 = seed;
+        do
+        {
+          seed = mix(r8(p) ^ SECRET[1], r8(p + 8) ^ seed);
+          see1 = mix(r8(p + 16) ^ SECRET[2], r8(p + 24) ^ see1);
+          see2 = mix(r8(p + 32) ^ SECRET[3], r8(p + 40) ^ see2);
+          p += 48;
+          i -= 48;
+        } while (i > 48);
+        seed ^= see1 ^ see2;
+      }
+      for (; i > 16; i -= 16, p += 16)
+        seed = mix(r8(p) ^ SECRET[1], r8(p + 8) ^ seed);
+      a = r8(p + i - 16);
+      b = r8(p + i - 8);
+    }
+
+    a ^= SECRET[1];
+    b ^= seed;
+    mum(a, b);
+    return mix(a ^ SECRET[0] ^ len, b ^ SECRET[1]);
+  }
+
+private:
+  static constexpr uint64_t SECRET[4] = {0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull, 0x4b33a62ed433d4a3ull,
+                                         0x4d5a2da51de1aa47ull};
+
+  static uint64_t r8(const uint8_t *p)
+  {
+    uint64_t v;
+    std::memcpy(&v, p, 8);
+    return v;
+  }
+
+  static uint64_t r4(const uint8_t *p)
+  {
+    uint32_t v;
+    std::memcpy(&v, p, 4);
+    return v;
+  }
+
+  // 64x64 -> 128 bit multiply, low half into a, high half into b
+  static void mum(uint64_t &a, uint64_t &b)
+  {
+    __uint128_t r = static_cast<__uint128_t>(a) * b;
+    a = static_cast<uint64_t>(r);
+    b = static_cast<uint64_t>(r >> 64);
+  }
+
+  static uint64_t mix(uint64_t a, uint64_t b)
+  {
+    mum(a, b);
+    return a ^ b;
+  }
+};
+
+/**
+ * @brief Adapts XXHash64 to the Leaf_map hasher interface.
+ */
+struct Xxhash64
+{
+  uint64_t operator()(std::string_view s) const noexcept { return XXHash64::hash(s.data(), s.size(), 0); }
+};
+
+/**
+ * @brief A leaf value as stored: raw bytes, or a number kept in binary form so counters update without parsing.
+ *
+ * Byte values view the map's storage and follow the same lifetime rules as any other view (see safety.md). Numbers
+ * render to text on demand, text() formats into a caller buffer without allocating.
+ */
+class Leaf_value
+{
+public:
+  enum class Type : uint8_t { BYTES, INT, DOUBLE };
+
+  static constexpr size_t TEXT_MAX = 32; ///< Buffer size text() needs for a number
+
+  Leaf_value(std::string_view bytes) : _type(Type::BYTES), _bytes(bytes) {}
+  explicit Leaf_value(int64_t i) : _type(Type::INT), _int(i) {}
+  explicit Leaf_value(double d) : _type(Type::DOUBLE), _double(d) {}
+
+  Type type() const { return _type; }
+  bool is_number() const { return _type != Type::BYTES; }
+
+  int64_t as_int() const { return _int; }
+  double as_double() const { return _type == Type::INT ? static_cast<double>(_int) : _double; }
+  std::string_view bytes() const { return _bytes; }
+
+  /**
+   * @brief Text form of the value. Numbers are formatted into `buf`, bytes are returned as they are.
+   */
+  std::string_view text(char (&buf)[TEXT_MAX]) const
+  {
+    switch (_type)
+    {
+      case Type::INT:    return {buf, static_cast<size_t>(std::to_chars(buf, buf + TEXT_MAX, _int).ptr - buf)};
+      case Type::DOUBLE: return {buf, static_cast<size_t>(std::to_chars(buf, buf + TEXT_MAX, _double).ptr - buf)};
+      default:           return _bytes;
+    }
+  }
+
+  std::string to_string() const
+  {
+    char buf[TEXT_MAX];
+    return std::string(text(buf));
+  }
+
+  /// Compares the text form
+  bool operator==(std::string_view s) const
+  {
+    char buf[TEXT_MAX];
+    return text(buf) == s;
+  }
+
+  /**
+   * @brief Parse a number in any form std::from_chars accepts ("42", "-3", "0.5", "1e3").
+   */
+  static std::optional<Leaf_value> parse_number(std::string_view s)
+  {
+    const char *end = s.data() + s.size();
+    int64_t i;
+    if (auto [ptr, ec] = std::from_chars(s.data(), end, i); ec == std::errc() && ptr == end && !s.empty())
+      return Leaf_value(i);
+    double d;
+    if (auto [ptr, ec] = std::from_chars(s.data(), end, d); ec == std::errc() && ptr == end && !s.empty() && std::isfinite(d))
+      return Leaf_value(d);
+    return std::nullopt;
+  }
+
+  /**
+   * @brief The value to store for `s`: a number if `s` is exactly how that number formats ("42", "2.5", but not
+   * "042" or "2.50"), so storing it as a number gives back the same bytes, otherwise the bytes themselves.
+   */
+  static Leaf_value encode(std::string_view s)
+  {
+    if (s.empty() || s.size() >= TEXT_MAX || !(s[0] == '-' || (s[0] >= '0' && s[0] <= '9')))
+      return s;
+    if (auto n = parse_number(s))
+      if (*n == s)
+        return *n;
+    return s;
+  }
+
+private:
+  Type _type;
+  union
+  {
+    std::string_view _bytes;
+    int64_t _int;
+    double _double;
+  };
+};
+
+/**
+ * @brief Probe-length and sizing counters of a Leaf_map, see Basic_leaf_map::stats().
+ */
+struct Leaf_map_stats
+{
+  size_t size;        ///< Live entries
+  size_t capacity;    ///< Slots of the table receiving inserts
+  double load_factor; ///< size / capacity
+  size_t max_probe;   ///< Slots inspected by a lookup of the worst placed key
+  double avg_probe;   ///< Mean slots inspected by a successful lookup
+  size_t rehashes;    ///< Resizes started, including arena compactions
+  size_t bytes;       ///< Memory held, see Basic_leaf_map::bytes()
+};
 
 /**
  * @brief A lightweight open-addressed hash map specialized for string-to-string mapping.
  *
- * Uses linear probing, fingerprinting for fast comparisons, and supports O(1) access.
+ * Uses Robin Hood linear probing over a SwissTable-style layout: one control byte per slot (0 = empty, else high bit + 7-bit
+ * hash fingerprint) kept in its own array, separate from the key/value slots. Probes compare 16 control bytes at a
+ * time (SSE2, scalar fallback), so slots whose fingerprint does not match are skipped without touching key memory.
+ * All lookups take std::string_view, so keys can be probed straight out of a network buffer.
+ *
+ * A slot is 40 bytes: the low half of the key's hash, an expiry deadline and two 16-byte string handles. Strings up to 12 bytes live in the handle;
+ * longer ones keep a 4-byte prefix there and the rest in a per-table append-only arena, so entries cost no
+ * allocation of their own and most key compares never leave the slot. Views handed out stay valid until the next
+ * change to the map.
+ *
+ * Growing is incremental: the full table is kept next to its replacement and drained a few slots per put/erase,
+ * lookups consult both, so no single operation pays for moving the whole map.
+ *
+ * Entries may carry a deadline in Unix seconds (see coarse_clock). Expired entries are invisible to lookups and
+ * iteration at once, and are removed when a mutation or a non-const get() runs into them, when a resize drains them,
+ * or by erase_expired(). Until then they still count in size().
+ *
+ * Each key carries a CLOCK reference bit, set by lookups and writes, for evict() to sweep. A table that erasing
+ * leaves mostly empty shrinks the same incremental way it grows.
  * Does not preserve insertion order. Not thread-safe.
+ *
+ * @tparam Hasher Callable mapping std::string_view to a 64-bit hash. The top 7 bits become the fingerprint, the low
+ *                bits pick the slot, so both ends need to be well mixed.
  */
-class Leaf_map
+template <class Hasher = Wyhash>
+class Basic_leaf_map
 {
-  struct bucket
+  static constexpr size_t GROUP = 16;          ///< Control bytes compared per probe step
+  static constexpr uint8_t EMPTY = 0x00;       ///< Control byte of an empty slot, so zeroed memory is an empty table
+  static constexpr uint8_t DELETED = 0x01;     ///< Drained slot of the old table while resizing, never ends a probe
+  static constexpr uint8_t FULL = 0x80;        ///< High bit set on every full slot, low 7 bits = fingerprint
+  static constexpr size_t MIGRATE_STEP = 4;    ///< Old slots visited per mutation while resizing, per old/new size
+  static constexpr size_t SHRINK_MAX = 8;      ///< Most a table shrinks by in one resize
+  static constexpr size_t RELEASE_STEP = 4096; ///< Drained old slots handed back to the kernel at a time
+
+  /**
+   * @brief 16-byte string handle.
+   *
+   * Up to INLINE bytes are stored in the handle itself. Longer strings keep their first 4 bytes inline, so most
+   * mismatching keys are rejected without leaving the slot, followed by a reference to the full bytes in the table's
+   * arena.
+   */
+  struct packed_str
+  {
+    static constexpr size_t INLINE = 12;
+
+    uint32_t size : 29;
+    uint32_t type : 2;       ///< Leaf_value::Type of a value, numbers are stored inline in binary form
+    mutable uint32_t referenced : 1; ///< CLOCK reference bit of a key: read or written since the eviction hand last passed
+    char bytes[INLINE]; ///< Inline data, or a 4-byte prefix followed by the arena reference
+
+    bool is_inline() const { return size <= INLINE; }
+
+    uint64_t ref() const
+    {
+      uint64_t r;
+      std::memcpy(&r, bytes + 4, sizeof(r));
+      return r;
+    }
+  };
+  static_assert(sizeof(packed_str) == 16);
+
+  struct slot
   {
-    uint8_t ctrl;      ///< Control byte: high bit = empty/deleted, low 7 bits = hash fingerprint
-    std::string key;   ///< Key string
-    std::string value; ///< Value string
-    bucket() : ctrl(0x80) {} ///< Default: mark as empty
+    uint32_t hash;    ///< Low half of the key's hash, enough to place it in any table, so resizing never rehashes keys
+    uint32_t expiry;  ///< Unix second the entry expires at, 0 = never
+    packed_str key;   ///< Key
+    packed_str value; ///< Value
   };
+  static_assert(sizeof(slot) == 40 && std::is_trivially_copyable_v<slot>);
 
-  std::vector<bucket> _store; ///< Hash table buckets
-  size_t _mask;               ///< Mask for mod-indexing
-  size_t _size;               ///< Number of live entries
-  float _max_load;            ///< Max load factor before resizing
+  /**
+   * @brief Control bytes, slots and string bytes of one table.
+   *
+   * `ctrl` holds capacity + GROUP - 1 bytes: the first GROUP - 1 are mirrored past the end, so a group can be
+   * loaded at any slot without wrapping. Capacity is a power of two and at least GROUP.
+   *
+   * Both arrays come straight from calloc/malloc and slots are plain bytes, so allocating a table costs nothing
+   * proportional to its capacity: the kernel hands out zeroed pages as they are first touched.
+   *
+   * Strings too long for a slot live in the table's own arena. Overwritten and erased bytes stay there, counted in
+   * `dead`, until the entries move to a new table, which copies only live strings.
+   */
+  struct table
+  {
+    uint8_t *ctrl;    ///< Control bytes, mirrored tail
+    slot *slots;      ///< Key/value pairs, parallel to ctrl
+    size_t mask;      ///< Capacity - 1
+    size_t live = 0;  ///< Number of full slots
+    Byte_arena arena; ///< Bytes of strings longer than packed_str::INLINE
+    size_t dead = 0;  ///< Arena bytes no longer referenced
+    std::vector<size_t> probes; ///< probes[d]: full slots d slots past their ideal slot
 
-  static constexpr uint8_t h2(uint64_t h) { return static_cast<uint8_t>(h >> 57); }
+    explicit table(size_t cap)
+        : ctrl(static_cast<uint8_t *>(std::calloc(cap + GROUP - 1, 1))),
+          slots(static_cast<slot *>(std::malloc(cap * sizeof(slot)))), mask(cap - 1)
+    {
+      assert(cap <= (size_t{1} << 32));
+      if (!ctrl || !slots)
+      {
+        std::free(ctrl);
+        std::free(slots);
+        throw std::bad_alloc();
+      }
+    }
+
+    table(table &&o) noexcept
+        : ctrl(std::exchange(o.ctrl, nullptr)), slots(std::exchange(o.slots, nullptr)), mask(o.mask),
+          live(std::exchange(o.live, 0)), arena(std::move(o.arena)), dead(std::exchange(o.dead, 0)),
+          probes(std::move(o.probes)) {}
+
+    table &operator=(table &&o) noexcept
+    {
+      std::swap(ctrl, o.ctrl);
+      std::swap(slots, o.slots);
+      std::swap(mask, o.mask);
+      std::swap(live, o.live);
+      std::swap(arena, o.arena);
+      std::swap(dead, o.dead);
+      std::swap(probes, o.probes);
+      return *this;
+    }
+
+    ~table()
+    {
+      std::free(ctrl);
+      std::free(slots);
+    }
+
+    size_t capacity() const { return mask + 1; }
+    bool full(size_t i) const { return ctrl[i] & FULL; }
+
+    /// How far full slot `i` sits past its ideal slot
+    size_t distance_of(size_t i) const { return (i - slots[i].hash) & mask; }
+
+    /// Bytes held by the table
+    size_t bytes() const
+    {
+      return capacity() * (sizeof(slot) + 1) + GROUP - 1 + arena.bytes() + probes.capacity() * sizeof(size_t);
+    }
+
+    void set_ctrl(size_t i, uint8_t c)
+    {
+      ctrl[i] = c;
+      if (i < GROUP - 1)
+        ctrl[i + capacity()] = c;
+    }
+
+    /// Fill empty slot `i`
+    void emplace(size_t i, uint8_t c, const slot &s)
+    {
+      slots[i] = s;
+      set_ctrl(i, c);
+      ++live;
+      size_t d = distance_of(i);
+      if (d >= probes.size())
+        probes.resize(d + 1);
+      ++probes[d];
+    }
+
+    /// Empty full slot `i`, marking it `mark`. The strings stay where they are, for a shift to reuse
+    void clear(size_t i, uint8_t mark = EMPTY)
+    {
+      --probes[distance_of(i)];
+      set_ctrl(i, mark);
+      --live;
+    }
+
+    /// Hand the whole pages under slots [from, to) back to the kernel, none of them may be full
+    void release(size_t from, size_t to)
+    {
+      constexpr uintptr_t PAGE = 4096;
+      uintptr_t begin = (reinterpret_cast<uintptr_t>(slots + from) + PAGE - 1) & ~(PAGE - 1);
+      uintptr_t end = reinterpret_cast<uintptr_t>(slots + to) & ~(PAGE - 1);
+      if (begin < end)
+        madvise(reinterpret_cast<void *>(begin), end - begin, MADV_DONTNEED);
+    }
+
+    std::string_view view(const packed_str &p) const
+    {
+      return p.is_inline() ? std::string_view(p.bytes, p.size) : std::string_view(arena.data(p.ref()), p.size);
+    }
+
+    Leaf_value value(const packed_str &p) const
+    {
+      switch (static_cast<Leaf_value::Type>(p.type))
+      {
+        case Leaf_value::Type::INT:
+        {
+          int64_t i;
+          std::memcpy(&i, p.bytes, sizeof(i));
+          return Leaf_value(i);
+        }
+        case Leaf_value::Type::DOUBLE:
+        {
+          double d;
+          std::memcpy(&d, p.bytes, sizeof(d));
+          return Leaf_value(d);
+        }
+        default:
+          return view(p);
+      }
+    }
+
+    bool equals(const packed_str &p, std::string_view s) const
+    {
+      if (p.size != s.size() || s.empty())
+        return p.size == s.size();
+      if (p.is_inline())
+        return std::memcmp(p.bytes, s.data(), s.size()) == 0;
+      return std::memcmp(p.bytes, s.data(), 4) == 0 && std::memcmp(arena.data(p.ref()) + 4, s.data() + 4, s.size() - 4) == 0;
+    }
+
+    /// Copy `s`, at most MAX_STRING bytes, into this table
+    packed_str pack(std::string_view s)
+    {
+      packed_str p;
+      p.size = static_cast<uint32_t>(s.size());
+      p.type = static_cast<uint32_t>(Leaf_value::Type::BYTES);
+      p.referenced = 0;
+      if (p.is_inline())
+      {
+        std::memcpy(p.bytes, s.data(), s.size());
+        return p;
+      }
+      std::memcpy(p.bytes, s.data(), 4);
+      uint64_t r = arena.append(s);
+      std::memcpy(p.bytes + 4, &r, sizeof(r));
+      return p;
+    }
+
+    /// Copy `v` into this table, numbers in binary form
+    packed_str pack(const Leaf_value &v)
+    {
+      if (!v.is_number())
+        return pack(v.bytes());
+
+      packed_str p;
+      p.size = 8;
+      p.type = static_cast<uint32_t>(v.type());
+      p.referenced = 0;
+      if (v.type() == Leaf_value::Type::INT)
+      {
+        int64_t i = v.as_int();
+        std::memcpy(p.bytes, &i, sizeof(i));
+      }
+      else
+      {
+        double d = v.as_double();
+        std::memcpy(p.bytes, &d, sizeof(d));
+      }
+      return p;
+    }
+
+    /// Replace the value of `p` with `v`
+    void assign(packed_str &p, const Leaf_value &v)
+    {
+      if (v.is_number())
+      {
+        forget(p);
+        p = pack(v);
+        return;
+      }
+
+      std::string_view s = v.bytes();
+      if (!p.is_inline() && s.size() > packed_str::INLINE && s.size() <= p.size)
+      {
+        // Long string that still fits, overwrite its arena bytes
+        std::memcpy(arena.data(p.ref()), s.data(), s.size());
+        std::memcpy(p.bytes, s.data(), 4);
+        dead += p.size - s.size();
+        p.size = static_cast<uint32_t>(s.size());
+        return;
+      }
+      forget(p);
+      p = pack(s);
+    }
+
+    /// Count the arena bytes of `p` as dead
+    void forget(const packed_str &p)
+    {
+      if (!p.is_inline())
+        dead += p.size;
+    }
+  };
+
+  /**
+   * @brief GROUP control bytes loaded at once, answering "which match this fingerprint" and "which are empty" as
+   * bitmasks (bit i = slot pos + i).
+   */
+  struct group
+  {
+#if defined(__SSE2__)
+    __m128i _ctrl;
+
+    explicit group(const uint8_t *p) : _ctrl(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p))) {}
+
+    uint32_t match(uint8_t fp) const
+    {
+      return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(_ctrl, _mm_set1_epi8(static_cast<char>(fp)))));
+    }
+
+    uint32_t empty() const { return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(_ctrl, _mm_setzero_si128()))); }
+#else
+    const uint8_t *_ctrl;
+
+    explicit group(const uint8_t *p) : _ctrl(p) {}
+
+    uint32_t match(uint8_t fp) const
+    {
+      uint32_t m = 0;
+      for (size_t i = 0; i < GROUP; ++i) m |= uint32_t(_ctrl[i] == fp) << i;
+      return m;
+    }
+
+    uint32_t empty() const
+    {
+      uint32_t m = 0;
+      for (size_t i = 0; i < GROUP; ++i) m |= uint32_t(_ctrl[i] == EMPTY) << i;
+      return m;
+    }
+#endif
+  };
+
+  table _t;                           ///< Table receiving inserts
+  std::optional<table> _old;          ///< Table being drained into _t while resizing
+  size_t _migrated = 0;               ///< Slots of _old drained so far
+  size_t _released = 0;               ///< Slots of _old whose pages went back to the kernel
+  size_t _size;                       ///< Number of live entries in both tables
+  size_t _rehashes = 0;               ///< Resizes started, including arena compactions
+  size_t _hand = 0;                   ///< Next slot the eviction sweep visits, numbered across _old then _t
+  float _max_load;                    ///< Max load factor before resizing
+  [[no_unique_address]] Hasher _hash; ///< Key hasher
+
+  static constexpr uint8_t h2(uint64_t h) { return FULL | static_cast<uint8_t>(h >> 57); }
 
 public:
+  static constexpr size_t MAX_STRING = (size_t{1} << 29) - 1; ///< Longest key or value, what packed_str::size holds
+
   /**
-   * @brief Construct a fast_strmap with optional initial capacity.
+   * @brief Construct a map with optional initial capacity.
    *
-   * @param initial Minimum capacity (rounded to next power of 2)
+   * @param initial Minimum capacity (rounded to next power of 2, at least 16)
    */
-  Leaf_map(size_t initial = 16)
-      : _store(next_pow2(initial)), _mask(_store.size() - 1), _size(0), _max_load(0.65f) {}
+  Basic_leaf_map(size_t initial = 16)
+      : _t(next_pow2(initial < GROUP ? GROUP : initial)), _size(0), _max_load(0.875f) {}
 
   /**
-   * @brief Insert or update a key-value pair.
+   * @brief Insert or update a key-value pair. Values that are the canonical text of a number are stored as that
+   * number, see Leaf_value::encode().
    *
    * @param k Key
    * @param v Value
-   * @return Pointer to stored value string
+   * @return The stored value, valid until the next change to the map, or an error if `k` or `v` is longer than
+   * MAX_STRING
    */
-  std::string *put(const std::string &k, const std::string &v)
+  std::expected<Leaf_value, std::string_view> put(std::string_view k, std::string_view v, uint32_t expiry = 0)
   {
+    return put(k, Leaf_value::encode(v), expiry);
+  }
+
+  /**
+   * @brief Insert or update a key-value pair, storing `v` with its type.
+   *
+   * @param expiry Unix second the entry expires at, 0 for never. Replaces any deadline the key had.
+   */
+  std::expected<Leaf_value, std::string_view> put(std::string_view k, const Leaf_value &v, uint32_t expiry = 0)
+  {
+    if (k.size() > MAX_STRING || (!v.is_number() && v.bytes().size() > MAX_STRING))
+      return std::unexpected("key or value is too long");
+
     grow_if_needed();
-    uint64_t h = wyhash_str(k);
-    uint8_t fp = h2(h);
-    size_t idx = h & _mask, dist = 0;
+    if (_old)
+      migrate(migrate_step());
 
-    for (;;)
+    uint64_t h = _hash(k);
+    if (auto [t, idx] = find_slot(k, h); t)
     {
-      bucket &b = _store[idx];
-      if (is_empty(b))
-      {
-        // Empty slot found — insert new pair
-        b.ctrl = fp;
-        b.key = k;
-        b.value = v;
-        ++_size;
-        return &b.value;
-      }
-      if (b.ctrl == fp && b.key == k)
-      {
-        // Key match — overwrite
-        b.value = v;
-        return &b.value;
-      }
-      // Continue probing
-      ++dist;
-      ++idx;
-      idx &= _mask;
+      t->assign(t->slots[idx].value, v);
+      t->slots[idx].expiry = expiry;
+      t->slots[idx].key.referenced = 1;
+      return t->value(t->slots[idx].value);
     }
+
+    // Not present — insert new pair, referenced so it survives the next pass of the eviction hand
+    slot s{static_cast<uint32_t>(h), expiry, _t.pack(k), _t.pack(v)};
+    s.key.referenced = 1;
+    size_t idx = insert(_t, s, h2(h));
+    ++_size;
+    return _t.value(_t.slots[idx].value);
   }
 
   /**
-   * @brief Lookup key. Returns pointer to value if found, or nullptr.
+   * @brief Lookup key. Leaves expired entries in place, but still sets the key's reference bit, which is mutable
+   * for this.
    *
    * @param k Key to search
-   * @return Pointer to stored value, or nullptr
+   * @return The value, valid until the next change to the map, or std::nullopt
    */
-  std::string *get(const std::string &k)
+  std::optional<Leaf_value> get(std::string_view k) const
   {
-    uint64_t h = wyhash_str(k);
-    uint8_t fp = h2(h);
-    size_t idx = h & _mask, dist = 0;
+    if (auto [t, idx] = find_slot(k, _hash(k)); t && !expired(t->slots[idx]))
+      return touch(t->slots[idx], *t);
+    return std::nullopt;
+  }
 
-    for (;;)
+  /**
+   * @brief Lookup key, removing it if it has expired.
+   */
+  std::optional<Leaf_value> get(std::string_view k)
+  {
+    auto [t, idx] = find_slot(k, _hash(k));
+    if (!t)
+      return std::nullopt;
+    if (expired(t->slots[idx]))
     {
-      bucket &b = _store[idx];
-      if (is_empty(b))
-        return nullptr;
+      remove(t, idx);
+      return std::nullopt;
+    }
+    return touch(t->slots[idx], *t);
+  }
 
-      // Fast fingerprint + first-char shortcut, then full key compare
-      if (b.ctrl == fp && b.key[0] == k[0] && b.key == k)
-        return &b.value;
+  /**
+   * @brief Add `delta` to the number stored at `k` in place. A missing key counts as 0, a byte value counts if it
+   * parses as a number. Integers stay integers unless either side is a double.
+   *
+   * @return The new value, or an error if the stored value is not a number, the sum overflows or a new key is longer
+   * than MAX_STRING
+   */
+  std::expected<Leaf_value, std::string_view> incr(std::string_view k, const Leaf_value &delta)
+  {
+    uint64_t h = _hash(k);
+    auto [t, idx] = find_slot(k, h);
 
-      ++dist;
-      ++idx;
-      idx &= _mask;
+    Leaf_value current(int64_t{0});
+    if (t && expired(t->slots[idx]))
+      t->slots[idx].expiry = 0; // Starts over from 0 and, like a new key, lives forever
+    else if (t)
+    {
+      current = t->value(t->slots[idx].value);
+      if (!current.is_number())
+      {
+        auto parsed = Leaf_value::parse_number(current.bytes());
+        if (!parsed)
+          return std::unexpected("value is not a number");
+        current = *parsed;
+      }
     }
+
+    Leaf_value sum(int64_t{0});
+    if (current.type() == Leaf_value::Type::INT && delta.type() == Leaf_value::Type::INT)
+    {
+      int64_t i;
+      if (__builtin_add_overflow(current.as_int(), delta.as_int(), &i))
+        return std::unexpected("increment would overflow");
+      sum = Leaf_value(i);
+    }
+    else
+    {
+      double d = current.as_double() + delta.as_double();
+      if (!std::isfinite(d))
+        return std::unexpected("increment would overflow");
+      sum = Leaf_value(d);
+    }
+
+    if (t)
+    {
+      // Numbers live in the slot itself, nothing to allocate or migrate. The deadline is kept.
+      t->assign(t->slots[idx].value, sum);
+      t->slots[idx].key.referenced = 1;
+      return sum;
+    }
+    return put(k, sum);
   }
 
   /**
-   * @brief Safe lookup with optional reference wrapper
+   * @brief One step of a CLOCK sweep over the slots, resuming where the previous step stopped.
    *
-   * @param k Key to search
-   * @return std::optional<std::reference_wrapper<std::string>> 
-   *         Empty if key not found, wrapped reference if found
+   * Entries read or written since the hand last passed them lose their reference bit and are kept. Entries that
+   * were not, and expired ones, are erased. Also drains a pending resize, so the memory the erased entries held
+   * goes back to the system.
+   *
+   * @param budget Slots to visit at most
+   * @return {slots visited, entries erased}. Fewer visits than `budget` means the hand passed the last slot, the
+   *         next step starts over from the first.
    */
-  std::optional<std::reference_wrapper<std::string>> get_opt(const std::string& k) {
-    if (auto p = get(k)) {
-      return std::ref(*p);
+  std::pair<size_t, size_t> evict(size_t budget)
+  {
+    if (_old)
+      migrate(budget);
+
+    size_t visited = 0, erased = 0;
+    for (; visited < budget; ++visited)
+    {
+      size_t old_cap = _old ? _old->capacity() : 0;
+      if (_hand >= old_cap + _t.capacity())
+      {
+        _hand = 0;
+        break;
+      }
+
+      table *t = _hand < old_cap ? &*_old : &_t;
+      size_t idx = _hand < old_cap ? _hand : _hand - old_cap;
+      if (!t->full(idx))
+        ++_hand;
+      else if (slot &s = t->slots[idx]; s.key.referenced && !expired(s))
+      {
+        s.key.referenced = 0;
+        ++_hand;
+      }
+      else
+      {
+        // The hand stays put, the backward shift may have pulled the next entry into this slot
+        remove(t, idx);
+        ++erased;
+      }
     }
-    return std::nullopt;
+    return {visited, erased};
   }
 
   /**
-   * @brief Const version of safe lookup
+   * @brief Visit the live entries from position `pos` on, calling `fn(key, value, deadline)`, taking one unit of
+   * `budget` per slot looked at. Lets a caller walk a big map in slices, as long as the map is not changed in between.
+   *
+   * @return Position to carry on from, or SIZE_MAX once every slot was looked at
    */
-  std::optional<std::reference_wrapper<const std::string>> get_opt(const std::string& k) const {
-    if (auto p = get(k)) {
-      return std::cref(*p);
+  template <typename F>
+  size_t scan(size_t pos, size_t &budget, F &&fn) const
+  {
+    size_t old_cap = _old ? _old->capacity() : 0;
+    size_t end = old_cap + _t.capacity();
+    for (; pos < end && budget > 0; ++pos, --budget)
+    {
+      const table *t = pos < old_cap ? &*_old : &_t;
+      size_t idx = pos < old_cap ? pos : pos - old_cap;
+      if (t->full(idx) && !expired(t->slots[idx]))
+        fn(t->view(t->slots[idx].key), t->value(t->slots[idx].value), t->slots[idx].expiry);
     }
+    return pos < end ? pos : SIZE_MAX;
+  }
+
+  /**
+   * @brief Deadline of `k` in Unix seconds, 0 if it has none, std::nullopt if `k` is missing or expired.
+   */
+  std::optional<uint32_t> deadline(std::string_view k) const
+  {
+    if (auto [t, idx] = find_slot(k, _hash(k)); t && !expired(t->slots[idx]))
+      return t->slots[idx].expiry;
     return std::nullopt;
   }
 
-  /// Const overload of get()
-  std::string *get(const std::string &k) const { return const_cast<Leaf_map *>(this)->get(k); }
+  /**
+   * @brief Erase `k` if its deadline has passed. Returns true if it was removed.
+   */
+  bool erase_expired(std::string_view k)
+  {
+    auto [t, idx] = find_slot(k, _hash(k));
+    if (!t || !expired(t->slots[idx]))
+      return false;
+    remove(t, idx);
+    return true;
+  }
 
   /**
    * @brief Erase entry by key. Returns true if key existed.
    */
-  bool erase(const std::string &k)
+  bool erase(std::string_view k)
   {
-    uint64_t h = wyhash_str(k);
-    uint8_t fp = h2(h);
-    size_t idx = h & _mask;
+    if (_old)
+      migrate(migrate_step());
 
-    for (;;)
-    {
-      bucket &b = _store[idx];
-      if (is_empty(b))
-        return false;
-      if (b.ctrl == fp && b.key == k)
-      {
-        b.ctrl = 0x80; // Mark as empty
-        backward_shift(idx);
-        --_size;
-        return true;
-      }
-      ++idx;
-      idx &= _mask;
-    }
+    auto [t, idx] = find_slot(k, _hash(k));
+    if (!t)
+      return false;
+
+    bool live = !expired(t->slots[idx]);
+    remove(t, idx);
+    return live;
   }
 
   /**
@@ -186,29 +824,67 @@ public:
   bool empty() const { return _size == 0; }
 
   /**
-   * @brief Reserve at least `n` elements of capacity.
+   * @brief Returns true while an incremental resize is in progress.
+   */
+  bool resizing() const { return _old.has_value(); }
+
+  /**
+   * @brief Probe-length and sizing counters, for spotting bad key distributions. O(max probe length).
+   */
+  Leaf_map_stats stats() const
+  {
+    Leaf_map_stats st{_size, _t.capacity(), double(_size) / _t.capacity(), 0, 0, _rehashes, bytes()};
+    size_t inspected = 0;
+    for (const table *t : {&_t, _old ? &*_old : nullptr})
+      for (size_t d = 0; t && d < t->probes.size(); ++d)
+        if (t->probes[d] > 0)
+        {
+          st.max_probe = std::max(st.max_probe, d + 1);
+          inspected += t->probes[d] * (d + 1);
+        }
+    st.avg_probe = _size ? double(inspected) / _size : 0;
+    return st;
+  }
+
+  /**
+   * @brief Bytes held by the map outside the object itself.
+   */
+  size_t bytes() const { return _t.bytes() + (_old ? _old->bytes() : 0); }
+
+  /**
+   * @brief Reserve at least `n` elements of capacity. Resizes synchronously.
    */
   void reserve(size_t n)
   {
-    if (n > _store.size() * _max_load)
+    if (_old)
+      migrate(SIZE_MAX);
+    if (n > _t.capacity() * _max_load)
       rehash(next_pow2(n / _max_load + 1));
   }
 
   /**
-   * @brief Iterator for key-value pairs in the map.
-   * Provides `{const std::string&, std::string&}` on dereference.
+   * @brief Iterator for key-value pairs in the map, covering both tables while resizing.
+   * Provides `{std::string_view key, Leaf_value value}` on dereference.
    */
   struct iterator
   {
-    const std::vector<bucket> *_store;
-    size_t _idx, _end;
+    const table *_tables[2]; ///< Table being drained (or nullptr), then the live table
+    size_t _tab, _idx;
 
-    iterator(const std::vector<bucket> *s, size_t i)
-        : _store(s), _idx(i), _end(s->size()) { skip(); }
+    iterator(const table *old, const table *t, size_t tab)
+        : _tables{old, t}, _tab(tab), _idx(0) { skip(); }
 
     void skip()
     {
-      while (_idx < _end && is_empty((*_store)[_idx])) ++_idx;
+      for (; _tab < 2; ++_tab, _idx = 0)
+      {
+        const table *t = _tables[_tab];
+        if (t == nullptr)
+          continue;
+        while (_idx < t->capacity() && (!t->full(_idx) || expired(t->slots[_idx]))) ++_idx;
+        if (_idx < t->capacity())
+          return;
+      }
     }
 
     iterator &operator++()
@@ -218,43 +894,44 @@ public:
       return *this;
     }
 
-    bool operator!=(const iterator &o) const { return _idx != o._idx; }
+    bool operator!=(const iterator &o) const { return _tab != o._tab || _idx != o._idx; }
 
-    auto operator*() const -> std::pair<const std::string &, std::string &>
+    std::pair<std::string_view, Leaf_value> operator*() const
     {
-      auto &b = const_cast<bucket &>((*_store)[_idx]);
-      return {b.key, b.value};
+      const table *t = _tables[_tab];
+      return {t->view(t->slots[_idx].key), t->value(t->slots[_idx].value)};
     }
   };
 
   /// Returns iterator to beginning
-  iterator begin() const { return iterator(&_store, 0); }
+  iterator begin() const { return iterator(_old ? &*_old : nullptr, &_t, 0); }
 
   /// Returns iterator to end
-  iterator end() const { return iterator(&_store, _store.size()); }
+  iterator end() const { return iterator(nullptr, &_t, 2); }
 
   /**
    * @brief Lookup with optional fallback (UX wrapper).
    *
    * @param key Key to lookup
    * @param fallback Value to return if key is not found
-   * @return Reference to found value or fallback
+   * @return Found value or fallback
    */
-  const std::string &get_or(const std::string &key, const std::string &fallback) const
+  Leaf_value get_or(std::string_view key, std::string_view fallback) const
   {
-    auto *p = get(key);
-    return p ? *p : fallback;
+    return get(key).value_or(Leaf_value(fallback));
   }
 
   /**
    * @brief Check if key exists.
    */
-  bool contains(const std::string &key) const
+  bool contains(std::string_view key) const
   {
-    return get(key) != nullptr;
+    return get(key).has_value();
   }
 
 private:
+  static constexpr size_t COMPACT_MIN = 64 * 1024; ///< Dead arena bytes tolerated regardless of ratio
+
   static size_t next_pow2(size_t v)
   {
     size_t n = 1;
@@ -262,68 +939,213 @@ private:
     return n;
   }
 
-  static bool is_empty(const bucket &b) { return b.ctrl & 0x80; }
+  static bool expired(const slot &s) { return coarse_clock::expired(s.expiry); }
 
-  void grow_if_needed()
+  // Marks a slot found by a lookup as recently used and returns its value. The slot's cache line is already loaded
+  // for the key compare, and the bit is only written when it changes.
+  static Leaf_value touch(const slot &s, const table &t)
   {
-    if ((_size + 1) > _store.size() * _max_load)
-      rehash(_store.size() * 2);
+    if (!s.key.referenced)
+      s.key.referenced = 1;
+    return t.value(s.value);
   }
 
-  void rehash(size_t newcap)
+  // Empty slot `idx` of `t`, which must be _t or _old. Starts shrinking the table once it is mostly empty, down to a
+  // load of at most 1/2 but by SHRINK_MAX at most, so memory freed by erases and eviction goes back instead of staying
+  // reserved.
+  void remove(table *t, size_t idx)
   {
-    std::vector<bucket> newstore(newcap);
-    size_t newmask = newcap - 1;
+    t->forget(t->slots[idx].key);
+    t->forget(t->slots[idx].value);
+    if (t == &_t)
+    {
+      _t.clear(idx);
+      backward_shift(_t, idx);
+    }
+    else
+      t->clear(idx, DELETED); // Nothing is inserted into _old any more, no need to keep its clusters tight
+    --_size;
+
+    if (!_old && _t.capacity() > GROUP && _size * 8 < _t.capacity())
+      start_resize(std::max({GROUP, next_pow2(_size * 2), _t.capacity() / SHRINK_MAX}));
+  }
+
+  // Table and slot holding `k`, {nullptr, 0} if absent. Checks the table being drained too while resizing
+  std::pair<table *, size_t> find_slot(std::string_view k, uint64_t h)
+  {
+    if (auto [idx, found] = locate(_t, k, h); found)
+      return {&_t, idx};
+    if (_old)
+      if (auto [idx, found] = locate(*_old, k, h); found)
+        return {&*_old, idx};
+    return {nullptr, 0};
+  }
+
+  std::pair<const table *, size_t> find_slot(std::string_view k, uint64_t h) const
+  {
+    if (auto [idx, found] = locate(_t, k, h); found)
+      return {&_t, idx};
+    if (_old)
+      if (auto [idx, found] = locate(*_old, k, h); found)
+        return {&*_old, idx};
+    return {nullptr, 0};
+  }
+
+  /**
+   * @brief Probe table `t` for `k` a group at a time.
+   *
+   * @return {slot of k, true} if present, otherwise {first empty slot on its probe path, false}
+   */
+  static std::pair<size_t, bool> locate(const table &t, std::string_view k, uint64_t h)
+  {
+    uint8_t fp = h2(h);
+    for (size_t pos = h & t.mask;; pos = (pos + GROUP) & t.mask)
+    {
+      group g(t.ctrl + pos);
+      uint32_t empty = g.empty();
+      uint32_t match = g.match(fp);
+      // The probe sequence ends at the first empty slot, later fingerprint hits are not on it
+      if (empty)
+        match &= (empty & -empty) - 1;
 
-    for (auto &b : _store)
+      for (; match; match &= match - 1)
+      {
+        size_t idx = (pos + __builtin_ctz(match)) & t.mask;
+        // Full hash first, a fingerprint false positive then rarely looks at the key
+        const slot &s = t.slots[idx];
+        if (s.hash == static_cast<uint32_t>(h) && t.equals(s.key, k))
+          return {idx, true};
+      }
+      if (empty)
+        return {(pos + __builtin_ctz(empty)) & t.mask, false};
+    }
+  }
+
+  /**
+   * @brief Robin Hood insertion of an absent key into `t`, returns the slot `s` lands in.
+   *
+   * Walking from the ideal slot, the entry takes the place of the first one sitting closer to its own ideal slot,
+   * and the displaced entry carries on the walk. Probe lengths stay even and their maximum stays logarithmic, and
+   * every cluster stays ordered by ideal slot, which backward_shift() relies on.
+   */
+  static size_t insert(table &t, slot s, uint8_t c)
+  {
+    size_t placed = SIZE_MAX;
+    for (size_t idx = s.hash & t.mask, dist = 0;; idx = (idx + 1) & t.mask, ++dist)
     {
-      if (!is_empty(b))
+      if (!t.full(idx))
       {
-        uint64_t h = wyhash_str(b.key);
-        size_t idx = h & newmask, dist = 0;
-        uint8_t fp = h2(h);
+        t.emplace(idx, c, s);
+        return placed == SIZE_MAX ? idx : placed;
+      }
 
-        for (;; ++dist, ++idx, idx &= newmask)
-        {
-          bucket &dst = newstore[idx];
-          if (is_empty(dst))
-          {
-            dst.ctrl = fp;
-            dst.key = std::move(b.key);
-            dst.value = std::move(b.value);
-            break;
-          }
-        }
+      if (size_t d = t.distance_of(idx); d < dist)
+      {
+        slot evicted = t.slots[idx];
+        uint8_t evicted_c = t.ctrl[idx];
+        t.clear(idx);
+        t.emplace(idx, c, s);
+        if (placed == SIZE_MAX)
+          placed = idx;
+        s = evicted;
+        c = evicted_c;
+        dist = d;
       }
     }
+  }
 
-    _store.swap(newstore);
-    _mask = newmask;
+  // Move slot `s` of `from` into `to`, copying its long strings into the arena of `to`
+  static void transfer(const table &from, const slot &s, uint8_t c, table &to)
+  {
+    slot moved{s.hash, s.expiry, to.pack(from.view(s.key)), to.pack(from.value(s.value))};
+    moved.key.referenced = s.key.referenced;
+    insert(to, moved, c);
   }
 
-  void backward_shift(size_t hole)
+  // Starts an incremental resize: the full table is set aside and drained into a fresh one by later mutations.
+  // Each resize leaves at least a quarter of the new capacity as headroom, load 1/2 after a grow or a shrink, and
+  // draining visits MIGRATE_STEP * old/new capacity slots per mutation, so the old table is gone within a quarter of
+  // the new capacity in mutations, long before the next resize is due. A table whose arena is mostly dead
+  // bytes is drained into a fresh table, which compacts the arena. It keeps its size unless it is over half full,
+  // so a compaction leaves the same headroom as a grow.
+  void grow_if_needed()
   {
-    size_t idx = (hole + 1) & _mask;
+    bool full = (_size + 1) > _t.capacity() * _max_load;
+    bool garbage = _t.dead > COMPACT_MIN && _t.dead * 2 > _t.arena.size();
+    if (!full && (_old || !garbage))
+      return;
+    if (_old)
+      migrate(SIZE_MAX);
+    start_resize(full || _size * 2 > _t.capacity() ? _t.capacity() * 2 : _t.capacity());
+  }
 
-    for (;;)
-    {
-      auto &b = _store[idx];
-      if (is_empty(b))
-        break;
+  // Old slots a mutation drains, more when shrinking so a small table does not fill up before a big one is drained
+  size_t migrate_step() const { return MIGRATE_STEP * std::max<size_t>(1, _old->capacity() / _t.capacity()); }
 
-      uint64_t ideal = wyhash_str(b.key) & _mask;
-      if (distance(ideal, idx) == 0)
-        break;
+  // Sets the table aside to be drained into a fresh one of `cap` slots by later mutations
+  void start_resize(size_t cap)
+  {
+    _old.emplace(std::exchange(_t, table(cap)));
+    _migrated = _released = 0;
+    ++_rehashes;
+  }
 
-      _store[hole] = std::move(b);
-      b.ctrl = 0x80;
-      hole = idx;
-      idx = (hole + 1) & _mask;
+  /**
+   * @brief Move entries from _old into _t, visiting at most `budget` old slots.
+   *
+   * Drained slots are marked DELETED rather than empty, so probes in _old still run past them to the entries behind.
+   * Probes never read the slot of a DELETED control byte, so drained slot memory is released as the drain goes,
+   * instead of unmapping the whole old table in one go at the end.
+   */
+  void migrate(size_t budget)
+  {
+    table &old = *_old;
+    for (; budget > 0 && _migrated < old.capacity() && old.live > 0; --budget, ++_migrated)
+    {
+      if (old.full(_migrated))
+      {
+        // Expired entries are dropped here rather than carried over
+        if (expired(old.slots[_migrated]))
+          --_size;
+        else
+          transfer(old, old.slots[_migrated], old.ctrl[_migrated], _t);
+        old.clear(_migrated, DELETED);
+      }
+    }
+    if (_migrated == old.capacity() || old.live == 0)
+      _old.reset();
+    else if (_migrated - _released >= RELEASE_STEP)
+    {
+      old.release(_released, _migrated);
+      _released = _migrated;
     }
   }
 
-  static size_t distance(size_t a, size_t b)
+  void rehash(size_t newcap)
+  {
+    table next(newcap);
+
+    for (size_t i = 0; i < _t.capacity(); ++i)
+      if (_t.full(i))
+        transfer(_t, _t.slots[i], _t.ctrl[i], next);
+
+    _t = std::move(next);
+    ++_rehashes;
+  }
+
+  // Refill the hole left by an erase. Robin Hood keeps clusters ordered by ideal slot, so the entries after the hole
+  // move back one slot each until an empty slot or an entry already in its ideal slot.
+  static void backward_shift(table &t, size_t hole)
   {
-    return (b + (1ull << 63) - a) & ((1ull << 63) - 1);
+    for (size_t idx = (hole + 1) & t.mask; t.full(idx) && t.distance_of(idx) > 0; idx = (idx + 1) & t.mask)
+    {
+      slot s = t.slots[idx];
+      uint8_t c = t.ctrl[idx];
+      t.clear(idx);
+      t.emplace(hole, c, s);
+      hole = idx;
+    }
   }
 };
+
+using Leaf_map = Basic_leaf_map<>;
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief Slab allocator for objects of one type.
+ *
+ * Storage is carved out of slabs of `SLAB` objects and recycled through an intrusive free list, so creating and
+ * dropping objects costs no malloc/free in steady state and objects created together sit next to each other.
+ * Slabs are only returned to the system when the pool itself goes away. Not thread-safe.
+ *
+ * @tparam T    Object type
+ * @tparam SLAB Objects per slab
+ */
+template <typename T, std::size_t SLAB = 256>
+class Object_pool
+{
+  union slot
+  {
+    slot *next;                                   ///< Next free slot while this one is free
+    alignas(T) unsigned char storage[sizeof(T)];  ///< Object storage while in use
+  };
+
+  std::vector<std::unique_ptr<slot[]>> _slabs;
+  slot *_free = nullptr;
+  std::size_t _live = 0;
+
+public:
+  Object_pool() = default;
+  Object_pool(const Object_pool &) = delete;
+  Object_pool &operator=(const Object_pool &) = delete;
+
+  /**
+   * @brief Construct an object in pool storage.
+   */
+  template <typename... Args>
+  T *create(Args &&...args)
+  {
+    if (_free == nullptr)
+      grow();
+
+    // Unlink first, the object overwrites the free list pointer it shares storage with
+    slot *s = _free;
+    _free = s->next;
+    try
+    {
+      T *obj = ::new (static_cast<void *>(s->storage)) T(std::forward<Args>(args)...);
+      ++_live;
+      return obj;
+    }
+    catch (...)
+    {
+      s->next = _free;
+      _free = s;
+      throw;
+    }
+  }
+
+  /**
+   * @brief Destroy an object created by this pool and recycle its storage.
+   */
+  void destroy(T *obj)
+  {
+    obj->~T();
+    slot *s = reinterpret_cast<slot *>(obj);
+    s->next = _free;
+    _free = s;
+    --_live;
+  }
+
+  /// Number of objects currently alive
+  std::size_t live() const { return _live; }
+
+  /// Number of objects the pool can hold without allocating another slab
+  std::size_t capacity() const { return _slabs.size() * SLAB; }
+
+  /// Bytes held by the pool's slabs
+  std::size_t bytes() const { return _slabs.size() * SLAB * sizeof(slot); }
+
+private:
+  void grow()
+  {
+    auto slab = std::make_unique<slot[]>(SLAB);
+    // Thread the free list front to back so consecutive creates get consecutive addresses
+    for (std::size_t i = SLAB; i-- > 0;)
+    {
+      slab[i].next = _free;
+      _free = &slab[i];
+    }
+    _slabs.push_back(std::move(slab));
+  }
+};
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <string_view>
+#include <utility>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+/**
+ * @brief Bytes waiting to go out on one connection, in fixed-size chunks recycled through a per-thread pool.
+ *
+ * append() copies into the last chunk and takes another once it fills, so nothing queued is ever moved or
+ * reallocated. flush() hands all the chunks to sendmsg(2) as one iovec and gives back to the pool every chunk the
+ * socket took whole. The pool keeps up to `POOL_MAX` chunks, a reactor under steady backpressure does not malloc.
+ * Not thread-safe, buffers must be dropped on the thread that filled them.
+ */
+class Output_buffer
+{
+public:
+  static constexpr std::size_t CHUNK_SIZE = 16 * 1024;
+
+private:
+  static constexpr std::size_t POOL_MAX = 256;
+  static constexpr std::size_t IOV_MAX_BATCH = 64; ///< Chunks per sendmsg, 1 MB
+
+  struct chunk
+  {
+    chunk *next;
+    std::size_t used;
+    char data[CHUNK_SIZE];
+  };
+
+  static inline thread_local chunk *_pool = nullptr;
+  static inline thread_local std::size_t _pooled = 0;
+
+  chunk *_head = nullptr;
+  chunk *_tail = nullptr;
+  std::size_t _offset = 0; ///< Bytes of the head chunk already sent
+  std::size_t _size = 0;   ///< Bytes not sent yet
+
+public:
+  Output_buffer() = default;
+  ~Output_buffer()
+  {
+    while (_head) release(std::exchange(_head, _head->next));
+  }
+
+  Output_buffer(const Output_buffer &) = delete;
+  Output_buffer &operator=(const Output_buffer &) = delete;
+
+  bool empty() const { return _size == 0; }
+
+  /// Bytes not sent yet
+  std::size_t size() const { return _size; }
+
+  void append(std::string_view s)
+  {
+    _size += s.size();
+    while (!s.empty())
+    {
+      if (_tail == nullptr || _tail->used == CHUNK_SIZE)
+      {
+        chunk *c = acquire();
+        (_tail ? _tail->next : _head) = c;
+        _tail = c;
+      }
+      std::size_t n = std::min(s.size(), CHUNK_SIZE - _tail->used);
+      std::memcpy(_tail->data + _tail->used, s.data(), n);
+      _tail->used += n;
+      s.remove_prefix(n);
+    }
+  }
+
+  /**
+   * @brief Sends until the buffer is empty or the socket stops taking bytes.
+   *
+   * @return True once everything is sent. False with errno set otherwise, EAGAIN if the socket is full.
+   */
+  bool flush(int fd)
+  {
+    while (_head)
+    {
+      iovec iov[IOV_MAX_BATCH];
+      std::size_t count = 0;
+      for (chunk *c = _head; c && count < IOV_MAX_BATCH; c = c->next, ++count)
+      {
+        std::size_t skip = count == 0 ? _offset : 0;
+        iov[count] = {c->data + skip, c->used - skip};
+      }
+
+      msghdr msg{};
+      msg.msg_iov = iov;
+      msg.msg_iovlen = count;
+      ssize_t n = ::sendmsg(fd, &msg, MSG_NOSIGNAL);
+      if (n == -1 && errno == EINTR)
+        continue;
+      if (n == -1)
+        return false;
+      consume(static_cast<std::size_t>(n));
+    }
+    return true;
+  }
+
+private:
+  void consume(std::size_t n)
+  {
+    _size -= n;
+    while (n > 0)
+    {
+      std::size_t left = _head->used - _offset;
+      if (n < left)
+      {
+        _offset += n;
+        return;
+      }
+      n -= left;
+      _offset = 0;
+      release(std::exchange(_head, _head->next));
+    }
+    if (_head == nullptr)
+      _tail = nullptr;
+  }
+
+  static chunk *acquire()
+  {
+    chunk *c = _pool;
+    if (c)
+    {
+      _pool = c->next;
+      --_pooled;
+    }
+    else
+      c = new chunk;
+    c->next = nullptr;
+    c->used = 0;
+    return c;
+  }
+
+  static void release(chunk *c)
+  {
+    if (_pooled == POOL_MAX)
+    {
+      delete c;
+      return;
+    }
+    c->next = _pool;
+    _pool = c;
+    ++_pooled;
+  }
+};
@@ -0,0 +1,254 @@
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "protocol.hpp"
+#include "coarse_clock.hpp"
+
+inline std::string_view trim(std::string_view str)
+{
+  size_t s = str.find_first_not_of(" \t\r\n");
+  if (s == std::string_view::npos)
+    return {};
+  size_t e = str.find_last_not_of(" \t\r\n");
+  return str.substr(s, e - s + 1);
+}
+
+// Splits the next space separated token off the front of `input`.
+inline std::string_view next_token(std::string_view &input)
+{
+  size_t s = input.find_first_not_of(" \t");
+  if (s == std::string_view::npos)
+  {
+    input = {};
+    return {};
+  }
+
+  size_t e = input.find_first_of(" \t", s);
+  std::string_view token = input.substr(s, e == std::string_view::npos ? e : e - s);
+  input.remove_prefix(e == std::string_view::npos ? input.size() : e);
+  return token;
+}
+
+// TTL in whole seconds, 1 to coarse_clock::TTL_MAX
+inline std::optional<uint32_t> parse_ttl(std::string_view s)
+{
+  uint32_t ttl;
+  auto [ptr, ec] = std::from_chars(s.data(), s.data() + s.size(), ttl);
+  if (ec != std::errc() || ptr != s.data() + s.size() || ttl == 0 || ttl > coarse_clock::TTL_MAX)
+    return std::nullopt;
+  return ttl;
+}
+
+std::optional<std::string_view> next_line(std::string_view buf, size_t &pos)
+{
+  size_t nl = buf.find('\n', pos);
+  if (nl == std::string_view::npos)
+    return std::nullopt;
+
+  std::string_view line = buf.substr(pos, nl - pos);
+  if (!line.empty() && line.back() == '\r')
+    line.remove_suffix(1);
+  pos = nl + 1;
+  return line;
+}
+
+std::optional<Query> parse_command(std::string_view input)
+{
+  input = trim(input);
+
+  if (input.empty())
+    return std::nullopt;
+
+  // Handle help command first
+  if (input == "help" || input == "-h" || input == "Help" || input == "h")
+    return Query{Query_type::HELP, {}, {}, {}};
+
+  if (input == "show" || input == "-p" || input == "print" || input == "Print" || input == "Show")
+    return Query{Query_type::SHOW, {}, {}, {}};
+
+  if (input == "save")
+    return Query{Query_type::SAVE, {}, {}, {}};
+
+  std::string_view cmd = next_token(input);
+  std::string_view args[5];
+  size_t count = 0;
+  for (; count < 5; ++count)
+    if (args[count] = next_token(input); args[count].empty())
+      break;
+
+  if (cmd == "create")
+  {
+    if (count < 1)
+      return std::nullopt;
+    return Query{Query_type::CREATE, args[0], {}, {}};
+  }
+
+  if (cmd == "del")
+  {
+    if (count < 2)
+      return std::nullopt;
+    return Query{Query_type::DEL, args[0], args[1], {}};
+  }
+
+  if (cmd == "rmtree")
+  {
+    if (count < 1)
+      return std::nullopt;
+    return Query{Query_type::RMTREE, args[0], {}, {}};
+  }
+
+  if (cmd == "expire")
+  {
+    if (count < 2)
+      return std::nullopt;
+    auto ttl = parse_ttl(args[1]);
+    if (!ttl)
+      return std::nullopt;
+    return Query{Query_type::EXPIRE, args[0], {}, {}, *ttl};
+  }
+
+  if (cmd == "stats")
+  {
+    if (count < 1)
+      return std::nullopt;
+    return Query{Query_type::STATS, args[0], {}, {}};
+  }
+
+  if (cmd == "get")
+  {
+    if (count < 2)
+      return std::nullopt;
+    return Query{Query_type::GET, args[0], args[1], {}};
+  }
+
+  if (cmd == "incr" || cmd == "decr")
+  {
+    if (count < 2)
+      return std::nullopt;
+    return Query{cmd == "incr" ? Query_type::INCR : Query_type::DECR, args[0], args[1], args[2]};
+  }
+
+  if (cmd == "put")
+  {
+    if (count < 3)
+      return std::nullopt;
+    if (count > 3 && args[3] == "ex")
+    {
+      auto ttl = count > 4 ? parse_ttl(args[4]) : std::nullopt;
+      if (!ttl)
+        return std::nullopt;
+      return Query{Query_type::PUT, args[0], args[1], args[2], *ttl};
+    }
+    return Query{Query_type::PUT, args[0], args[1], args[2]};
+  }
+
+  return std::nullopt;
+}
+
+template <typename T>
+inline T load_le(const char *p)
+{
+  T v;
+  std::memcpy(&v, p, sizeof(T));
+  return v;
+}
+
+// Length of the frame whose header starts at `h`, header included
+inline size_t frame_size(const char *h)
+{
+  return binary::HEADER_SIZE + load_le<uint16_t>(h + 1) + load_le<uint16_t>(h + 3) + load_le<uint32_t>(h + 5);
+}
+
+std::optional<Query> parse_frame(std::string_view buf, size_t &pos)
+{
+  if (buf.size() - pos < binary::HEADER_SIZE)
+    return std::nullopt;
+
+  const char *h = buf.data() + pos;
+  uint8_t op = static_cast<uint8_t>(h[0]);
+  size_t path_len = load_le<uint16_t>(h + 1);
+  size_t key_len = load_le<uint16_t>(h + 3);
+  size_t value_len = load_le<uint32_t>(h + 5);
+
+  size_t frame = frame_size(h);
+  if (frame > MAX_REQUEST_SIZE)
+    return Query{Query_type::TOO_LARGE, {}, {}, {}};
+  if (buf.size() - pos < frame)
+    return std::nullopt;
+
+  const char *body = h + binary::HEADER_SIZE;
+  Query q{Query_type::INVALID, {body, path_len}, {body + path_len, key_len}, {body + path_len + key_len, value_len}};
+  pos += frame;
+
+  switch (op)
+  {
+    case binary::OP_GET:    q._type = Query_type::GET;    break;
+    case binary::OP_PUT:    q._type = Query_type::PUT;    break;
+    case binary::OP_CREATE: q._type = Query_type::CREATE; break;
+    case binary::OP_STATS:  q._type = Query_type::STATS;  break;
+    case binary::OP_INCR:   q._type = Query_type::INCR;   break;
+    case binary::OP_DECR:   q._type = Query_type::DECR;   break;
+    case binary::OP_DEL:    q._type = Query_type::DEL;    break;
+    case binary::OP_RMTREE: q._type = Query_type::RMTREE; break;
+    case binary::OP_SAVE:   q._type = Query_type::SAVE;   break;
+    case binary::OP_PUT_EX:
+    case binary::OP_EXPIRE:
+    {
+      // TTL rides at the front of the value, a frame too short for it or with a TTL out of range stays INVALID
+      if (q._value.size() < sizeof(uint32_t))
+        break;
+      uint32_t ttl = load_le<uint32_t>(q._value.data());
+      if (ttl == 0 || ttl > coarse_clock::TTL_MAX)
+        break;
+      q._ttl = ttl;
+      q._value.remove_prefix(sizeof(uint32_t));
+      q._type = op == binary::OP_PUT_EX ? Query_type::PUT : Query_type::EXPIRE;
+      break;
+    }
+    default: break;
+  }
+  return q;
+}
+
+bool request_too_large(std::string_view buf, Protocol proto)
+{
+  if (proto == Protocol::BINARY)
+    return buf.size() >= binary::HEADER_SIZE && frame_size(buf.data()) > MAX_REQUEST_SIZE;
+
+  // A line of MAX_REQUEST_SIZE bytes may still be followed by "\r\n", only scan once that much is in
+  constexpr size_t with_terminator = MAX_REQUEST_SIZE + 2;
+  return buf.size() >= with_terminator && buf.substr(0, with_terminator).find('\n') == std::string_view::npos;
+}
+
+void append_reply(std::string &out, Protocol proto, Reply_kind kind, std::string_view body)
+{
+  if (proto == Protocol::BINARY)
+  {
+    char header[binary::REPLY_HEADER_SIZE];
+    header[0] = kind == Reply_kind::ERROR ? binary::STATUS_ERROR : binary::STATUS_OK;
+    uint32_t len = static_cast<uint32_t>(body.size());
+    std::memcpy(header + 1, &len, sizeof(len));
+    out.append(header, sizeof(header));
+    out.append(body);
+    return;
+  }
+
+  switch (kind)
+  {
+    case Reply_kind::OK:
+      out += "100 OK\r\n";
+      break;
+    case Reply_kind::RAW:
+      out += body;
+      break;
+    case Reply_kind::VALUE:
+    case Reply_kind::ERROR:
+      out += body;
+      out += "\r\n";
+      break;
+  }
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+
+/*
+ * Wire protocols. A connection speaks whichever protocol its first byte selects:
+ *
+ *  - Text: newline terminated commands, "put <path> <key> <value>\r\n". Every ASCII first byte picks text.
+ *  - Binary: length prefixed frames whose first byte is an opcode with the high bit set.
+ *
+ *      request : [u8 opcode][u16 path_len][u16 key_len][u32 value_len][path][key][value]
+ *      reply   : [u8 status][u32 body_len][body]
+ *
+ *    All integers are little endian. Values may contain any bytes, including spaces and newlines.
+ */
+
+enum class Protocol : uint8_t { UNKNOWN, TEXT, BINARY };
+
+enum class Query_type { GET, PUT, CREATE, HELP, DEL, RMTREE, SHOW, STATS, INCR, DECR, EXPIRE, SAVE, INVALID, TOO_LARGE };
+
+// Longest text command or binary frame a connection may send, values stay well below what a leaf can store
+constexpr size_t MAX_REQUEST_SIZE = 64 * 1024 * 1024;
+
+// Views into the connection's read buffer, valid until that buffer is consumed.
+struct Query
+{
+  Query_type _type;
+  std::string_view _path;
+  std::string_view _key;
+  std::string_view _value;
+  uint32_t _ttl = 0; // Seconds until expiry for PUT and EXPIRE, 0 = never
+};
+
+namespace binary
+{
+  constexpr uint8_t OP_GET    = 0x81;
+  constexpr uint8_t OP_PUT    = 0x82;
+  constexpr uint8_t OP_CREATE = 0x83;
+  constexpr uint8_t OP_STATS  = 0x84;
+  constexpr uint8_t OP_INCR   = 0x85; ///< Delta as decimal text in the value field, empty means 1
+  constexpr uint8_t OP_DECR   = 0x86;
+  constexpr uint8_t OP_PUT_EX = 0x87; ///< Value field is [u32 ttl seconds][value]
+  constexpr uint8_t OP_EXPIRE = 0x88; ///< Value field is [u32 ttl seconds], path only
+  constexpr uint8_t OP_DEL    = 0x89;
+  constexpr uint8_t OP_RMTREE = 0x8A; ///< Path only
+  constexpr uint8_t OP_SAVE   = 0x8B; ///< No fields
+
+  constexpr uint8_t STATUS_OK    = 0;
+  constexpr uint8_t STATUS_ERROR = 1;
+
+  constexpr size_t HEADER_SIZE = 1 + 2 + 2 + 4;
+  constexpr size_t REPLY_HEADER_SIZE = 1 + 4;
+}
+
+// Picks the protocol of a connection from its first byte.
+inline Protocol detect_protocol(char first) { return (static_cast<uint8_t>(first) & 0x80) ? Protocol::BINARY : Protocol::TEXT; }
+
+// Pops the next complete text command off `buf` starting at `pos`, accepts both "\r\n" and "\n" terminators.
+std::optional<std::string_view> next_line(std::string_view buf, size_t &pos);
+
+// Parses one text command, without its line terminator.
+std::optional<Query> parse_command(std::string_view input);
+
+// Parses the binary frame starting at buf[pos]. Returns std::nullopt and leaves `pos` alone if the frame is not complete
+// yet, otherwise advances `pos` past the frame. Unknown opcodes come back as Query_type::INVALID. A frame longer than
+// MAX_REQUEST_SIZE comes back as Query_type::TOO_LARGE as soon as its header is in, with `pos` left alone: the stream
+// cannot be framed past it and the connection has to go.
+std::optional<Query> parse_frame(std::string_view buf, size_t &pos);
+
+// Whether the request at the front of `buf` is already known to be longer than MAX_REQUEST_SIZE: a text line with no
+// terminator within the limit, or a frame whose header announces more. Looks no further than the first request.
+bool request_too_large(std::string_view buf, Protocol proto);
+
+enum class Reply_kind
+{
+  OK,    ///< Acknowledgement without a body
+  VALUE, ///< A stored value
+  RAW,   ///< Preformatted text such as help output
+  ERROR, ///< Error message
+};
+
+// Appends one reply to `out`, encoded for `proto`.
+void append_reply(std::string &out, Protocol proto, Reply_kind kind, std::string_view body = {});
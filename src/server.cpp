@@ -1,31 +1,51 @@
+#include <algorithm>
+#include <atomic>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
+#include <expected>
+#include <filesystem>
 #include <format>
 #include <coroutine>
+#include <latch>
 #include <print>
 #include <unordered_map>
 #include <vector>
-#include <queue>
 #include <optional>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <utility>
 
 #include <sys/socket.h>
 #include <sys/wait.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
 #include "data_tree.hpp"
+#include "image.hpp"
+#include "output_buffer.hpp"
+#include "protocol.hpp"
 #include "assert.hpp"
+#include "snapshot.hpp"
+#include "spsc_ring.hpp"
+#include "timer_wheel.hpp"
+#include "wal.hpp"
 #include "./server.hpp"
 
-std::unordered_map<int, std::coroutine_handle<>> FD_TO_HANDLE;
+// Every reactor thread runs its own event loop, so all loop state is thread local.
+thread_local std::unordered_map<int, std::coroutine_handle<>> FD_TO_HANDLE;
 
-enum Event_type { READ, WRITE, ACCEPT };
+enum Event_type { READ, WRITE, ACCEPT, WAKE, SYNCED };
 
-int init_server(uint16_t _port, const char *_host)
+int init_server(uint16_t _port, const char *_host, bool reuse_port)
 {
   sockaddr_in sock{};
   int skt = socket(AF_INET, SOCK_STREAM, 0);
@@ -33,6 +53,8 @@ int init_server(uint16_t _port, const char *_host)
 
   int opt = 1;
   __assert(setsockopt(skt, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == 0, std::format("setsockopt failed: {}", std::strerror(errno)));
+  if (reuse_port)
+    __assert(setsockopt(skt, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) == 0, std::format("setsockopt SO_REUSEPORT failed: {}", std::strerror(errno)));
 
   sock.sin_family = AF_INET;
   sock.sin_port = htons(_port);
@@ -129,92 +151,79 @@ struct Async_task
   bool done() const { return handle == nullptr || handle.done() || handle.promise().completed; }
 };
 
-struct Send_task
+struct Client
 {
-  struct promise_type
-  {
-    bool completed =  false;
-    Send_task get_return_object() { return Send_task{std::coroutine_handle<promise_type>::from_promise(*this)}; }
+  int fd;
+  int epfd;
+  uint16_t port;
+  std::string addr;
+  bool is_alive = true;
 
-    std::suspend_never initial_suspend() { return {}; }
-    std::suspend_never final_suspend() noexcept { return {}; }
+  Async_task * read_task;
 
-    void return_void() { }// completed = true; }
-    void unhandled_exception() { std::terminate(); }
-  };
+  // Bytes received but not yet consumed, may end in a partial command
+  std::string read_buf;
+  // Replies of the batch being processed, sent with one write once the batch is done
+  std::string reply_buf;
+  // Replies the socket did not take yet. Reading stops until they are sent.
+  Output_buffer unsent;
+  bool peer_closed = false;
+  Protocol protocol = Protocol::UNKNOWN; ///< Picked by the first byte the client sends
 
-  std::coroutine_handle<promise_type> handle;
+  ~Client()
+  { __assert(read_task == nullptr, "Must clear the read task before deleting client."); }
 
-  explicit Send_task(std::coroutine_handle<promise_type> h) : handle(h) {}
+  void flush_replies();
 
-  Send_task(Send_task &&other) noexcept : handle(other.handle) { other.handle = nullptr; }
+  bool try_send_unsent();
+};
 
-  Send_task &operator=(Send_task &&other) noexcept
-  {
-    if (this != &other)
-    {
-      if (handle)
-        handle.destroy();
-      handle = other.handle;
-      other.handle = nullptr;
-    }
-    return *this;
-  }
+// Map to track this reactor's clients by fd
+thread_local std::unordered_map<int, Client *> CLIENTS;
 
-  Send_task(const Send_task &) = delete;
-  Send_task &operator=(const Send_task &) = delete;
+// Keyspace shard owned by this reactor, shared by every connection. Only the owning thread ever touches it,
+// requests for other shards are routed through the reactor mailboxes, so no locking is needed.
+thread_local Tree TREE;
 
-  ~Send_task()
-  {
-    if (handle && !handle.done())
-    {
-      handle.destroy();
-    }
-  }
+void set_shard_max_memory(std::size_t bytes) { TREE.set_max_bytes(bytes); }
 
-  void resume() const
-  {
-    if (handle && !handle.done())
-      handle.resume();
-  }
+// Deadlines of this shard's entries and nodes. The event loop reaps at most EXPIRE_BUDGET of them per iteration.
+thread_local Timer_wheel TIMERS;
+constexpr std::size_t EXPIRE_BUDGET = 1024;
 
-  bool done() const { return handle == nullptr || handle.done() || handle.promise().completed; }
-};
+// Nodes of removed subtrees the event loop destroys per iteration
+constexpr std::size_t COLLECT_BUDGET = 256;
 
-struct Client
-{
-  int fd;
-  Tree tree = Tree{};
-  int epfd;
-  uint16_t port;
-  std::string addr;
-  bool is_sending = false;
-  std::queue<std::string> send_queue;
-  bool is_alive = true;
+// Write-ahead log shared by every reactor, null when writes are not logged. Set before any reactor starts.
+Wal *WAL = nullptr;
 
-  // Current send state
-  std::string current_send_data;
-  size_t current_send_offset = 0;
+void set_wal(Wal *wal) { WAL = wal; }
 
-  Async_task * read_task;
-  std::optional<Send_task> send_task;
+// Records of the writes this reactor applied during the current loop iteration, written as one batch at its end
+thread_local std::string WAL_BATCH;
+thread_local uint64_t WAL_RECORDS = 0;    // Records appended so far, tells whether a stretch of work logged anything
+thread_local uint64_t WAL_LAST_BATCH = 0; // Number of the last batch this reactor wrote
 
-  ~Client()
-  { __assert(read_task == nullptr, "Must clear the read task before deleting client."); }
+void log_write(const Wal_record &r)
+{
+  if (!WAL)
+    return;
+  append_record(WAL_BATCH, r);
+  ++WAL_RECORDS;
+}
 
-  void queue_send(const std::string &data)
-  {
-    send_queue.push(data);
-    if (!is_sending && is_alive)
-      try_start_next_send();
-  }
+// Snapshot file, empty when snapshots are off, and seconds between periodic saves, 0 for none. Set before any reactor
+// starts.
+std::string SNAPSHOT_PATH;
+unsigned SAVE_EVERY = 0;
 
-  void try_start_next_send();
-  bool try_send_current();
-};
+void set_snapshot(const std::string &path, unsigned every)
+{
+  SNAPSHOT_PATH = path;
+  SAVE_EVERY = every;
+}
 
-// Global map to track clients by fd
-std::unordered_map<int, Client *> CLIENTS;
+std::expected<void, std::string> start_save();
 
 struct Accept_awaitable
 {
@@ -238,10 +247,14 @@ struct Accept_awaitable
     __assert(client_fd != -1, std::format("Failed to accept from : {} : {}", client_fd, std::strerror(errno)));
 
     set_non_blocking(client_fd);
-    return Client{client_fd, {}, epfd, (uint16_t)port, ip_str};
+    return Client{client_fd, epfd, (uint16_t)port, ip_str};
   }
 };
 
+constexpr size_t RECV_CHUNK = 16 * 1024;
+// Most a read buffer holds after one wakeup, enough for the longest request a client may send and a bit of what follows
+constexpr size_t READ_LIMIT = MAX_REQUEST_SIZE + RECV_CHUNK;
+
 struct Recv_awaitable
 {
   Client *client;
@@ -273,22 +286,43 @@ struct Recv_awaitable
     FD_TO_HANDLE[client->fd] = handle;
   }
 
-  std::string await_resume()
+  // Drains the socket into client->read_buf until EAGAIN, as required by EPOLLET, or until the buffer holds READ_LIMIT
+  // bytes. What is left in the socket then is not lost: the next Recv_awaitable re-arms the fd with EPOLL_CTL_MOD,
+  // which reports it again while it is still readable. Returns false if nothing new arrived because the peer is gone.
+  bool await_resume()
   {
     if (!client || !client->is_alive)
-      return {};
+      return false;
 
-    // Try reading from client
-    char buf[1024];
-    ssize_t n = recv(client->fd, buf, sizeof(buf), 0);
-    if (n <= 0)
+    std::string &buf = client->read_buf;
+    size_t before = buf.size();
+    while (buf.size() < READ_LIMIT)
     {
-      if (client)
+      ssize_t n = 0;
+      size_t used = buf.size();
+      size_t room = std::min(std::max(RECV_CHUNK, buf.capacity() - used), READ_LIMIT - used);
+      buf.resize_and_overwrite(used + room, [&](char *p, size_t) {
+        n = recv(client->fd, p + used, room, 0);
+        return used + std::max<ssize_t>(n, 0);
+      });
+      if (n > 0)
+        continue;
+
+      if (n == 0)
+        client->peer_closed = true;
+      else if (errno == EINTR)
+        continue;
+      else if (errno != EAGAIN && errno != EWOULDBLOCK)
         client->is_alive = false;
-      return {};
+      break;
     }
 
-    return std::string(buf, n);
+    if (buf.size() == before && (client->peer_closed || !client->is_alive))
+    {
+      client->is_alive = false;
+      return false;
+    }
+    return true;
   }
 
   void resume()
@@ -319,15 +353,16 @@ struct Send_awaitable
     if (!client || !client->is_alive)
       return true;
 
-    return client->try_send_current();
+    return client->try_send_unsent();
   }
 
-  void await_suspend(std::coroutine_handle<> h)
+  // Stays suspended only once EPOLLOUT is armed, a client that can no longer be written to carries on at once
+  bool await_suspend(std::coroutine_handle<> h)
   {
     handle = h;
 
     if (!client || !client->is_alive)
-      return;
+      return false;
 
     epoll_event ev = {};
     ev.events = EPOLLOUT | EPOLLONESHOT | EPOLLET;
@@ -336,10 +371,10 @@ struct Send_awaitable
     if (epoll_ctl(client->epfd, EPOLL_CTL_MOD, client->fd, &ev) == -1)
     {
       std::println("epoll_ctl (send) failed: {}", std::strerror(errno));
-      if (client)
-        client->is_alive = false;
-      return;
+      client->is_alive = false;
+      return false;
     }
+    return true;
   }
 
   bool await_resume()
@@ -347,7 +382,7 @@ struct Send_awaitable
     if (!client || !client->is_alive)
       return true;
 
-    return client->try_send_current();
+    return client->try_send_unsent();
   }
 
   void resume()
@@ -357,257 +392,308 @@ struct Send_awaitable
   }
 };
 
-bool Client::try_send_current()
+bool Client::try_send_unsent()
 {
-  if (!is_alive || current_send_data.empty())
+  if (!is_alive || unsent.flush(fd))
     return true;
+  if (errno == EAGAIN || errno == EWOULDBLOCK)
+    return false; // Need to wait for EPOLLOUT
 
-  while (current_send_offset < current_send_data.length())
-  {
-    ssize_t n = ::send(fd, current_send_data.data() + current_send_offset, current_send_data.length() - current_send_offset, 0);
-    if (n == -1)
-    {
-      if (errno == EAGAIN || errno == EWOULDBLOCK)
-      {
-        // Need to wait for EPOLLOUT
-        return false;
-      }
-      else
-      {
-        std::println("Send error: {}", std::strerror(errno));
-        is_alive = false;
-        return true;
-      }
-    }
-    current_send_offset += n;
-  }
-
-  // Current message sent completely
-  current_send_data.clear();
-  current_send_offset = 0;
+  std::println("Send error: {}", std::strerror(errno));
+  is_alive = false;
   return true;
 }
 
-Send_task send_handler(Client *client)
+void Client::flush_replies()
 {
-  while (client && client->is_alive && client->is_sending)
-  {
-    Send_awaitable sender(client);
-    bool complete = co_await sender;
-
-    if (!client || !client->is_alive)
-      break;
-
-    if (complete)
-    {
-      // Current message done, try next
-      client->is_sending = false;
-      if (!client->send_queue.empty())
-        client->try_start_next_send();
-      break;
-    }
-    // If not complete, continue the loop to wait for more EPOLLOUT
-  }
-
-  if (client) {
-    client->is_sending = false;
-    client->send_task.reset(); // Clear the task when done
-  }
-  co_return;
-}
-
-void Client::try_start_next_send()
-{
-  if (is_sending || !is_alive || send_queue.empty())
+  if (reply_buf.empty() || !is_alive)
     return;
 
-  // Get next message
-  current_send_data = send_queue.front();
-  send_queue.pop();
-  current_send_offset = 0;
-  is_sending = true;
-
-  // Try immediate send
-  if (try_send_current())
-  {
-    // Sent completely, check for more
-    is_sending = false;
-    if (!send_queue.empty())
-      try_start_next_send();
-  }
-  else
-  {
-    // Need to wait for EPOLLOUT, start send handler coroutine
-    send_task.emplace(send_handler(this));
-    send_task->resume();
-  }
-}
-
-enum class Query_type { GET, PUT, CREATE, HELP, DEL, SHOW, INVALID };
-
-struct Query
-{
-  Query_type _type;
-  std::string _path;
-  std::string _key;
-  std::string _value;
-};
-
-inline void trim_left(std::string &str)
-{
-  size_t s = str.find_first_not_of(" \t");
-  if (s == std::string::npos)
-    str.clear();
-  else
-    str.erase(0, s);
-}
-
-inline void trim_right(std::string &str)
-{
-  size_t pos = str.find_last_not_of(" \r\n\t");
-  if (pos != std::string::npos)
-    str.erase(pos + 1);
-  else
-    str.clear();
-}
-
-std::vector<std::string> split_by_space(std::string input)
-{
-  std::vector<std::string> tokens;
-  trim_left(input);
-
-  while (!input.empty())
-  {
-    size_t space_pos = input.find(' ');
-    if (space_pos == std::string::npos)
-    {
-      tokens.push_back(input);
-      break;
-    }
-    else
-    {
-      tokens.push_back(input.substr(0, space_pos));
-      input.erase(0, space_pos + 1);
-      trim_left(input);
-    }
-  }
-  return tokens;
-}
-
-std::optional<Query> parse_command(std::string input)
-{
-  trim_right(input);
-  trim_left(input);
-
-  if (input.empty())
-    return std::nullopt;
-
-  // Handle help command first
-  if (input == "help" || input == "-h" || input == "Help" || input == "h")
-    return Query{Query_type::HELP, {}, {}, {}};
-
-  if (input == "show" || input == "-p" || input == "print" || input == "Print" || input == "Show")
-    return Query{Query_type::SHOW, {}, {}, {}};
-
-  auto tokens = split_by_space(input);
-  if (tokens.empty())
-    return std::nullopt;
-
-  Query result{Query_type::INVALID, {}, {}, {}};
-  const auto &cmd = tokens[0];
-
-  if (cmd == "create")
+  // Nothing is in flight when a batch ends: write straight from the reply buffer and keep its capacity for the next
+  ssize_t n = ::send(fd, reply_buf.data(), reply_buf.size(), MSG_NOSIGNAL);
+  if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
   {
-    if (tokens.size() < 2)
-      return std::nullopt;
-    result._type = Query_type::CREATE;
-    result._path = tokens[1];
-    return result;
-  }
-
-  if (cmd == "get")
-  {
-    if (tokens.size() < 3)
-      return std::nullopt;
-    result._type = Query_type::GET;
-    result._path = tokens[1];
-    result._key = tokens[2];
-    return result;
-  }
-
-  if (cmd == "put")
-  {
-    if (tokens.size() < 4)
-      return std::nullopt;
-    result._type = Query_type::PUT;
-    result._path = tokens[1];
-    result._key = tokens[2];
-    result._value = tokens[3];
-    return result;
+    std::println("Send error: {}", std::strerror(errno));
+    is_alive = false;
+    return;
   }
 
-  return std::nullopt;
+  size_t sent = n > 0 ? n : 0;
+  if (sent < reply_buf.size())
+    unsent.append(std::string_view(reply_buf).substr(sent));
+  reply_buf.clear();
 }
 
-void process_command(Client *client, const std::string &data)
+void execute_query(const Query &cmd, Protocol proto, std::string &out)
 {
-  if (!client || !client->is_alive)
-    return;
-
-  auto cmd = parse_command(data);
-  if (!cmd)
-  {
-    client->queue_send("Bad command\r\n");
-    return;
-  }
-
-  switch (cmd->_type)
+  switch (cmd._type)
   {
     case Query_type::HELP:
     {
-      std::string mess =
+      std::string_view mess =
           "Commands:\r\n"
           "  create <path>\r\n"
-          "  put <path> <key> <value>\r\n"
-          "  get <path> <key>\r\n";
-      client->queue_send(mess);
+          "  put <path> <key> <value> [ex <seconds>]\r\n"
+          "  get <path> <key>\r\n"
+          "  del <path> <key>\r\n"
+          "  rmtree <path>\r\n"
+          "  incr <path> <key> [delta]\r\n"
+          "  decr <path> <key> [delta]\r\n"
+          "  expire <path> <seconds>\r\n"
+          "  stats <path>\r\n"
+          "  save\r\n";
+      append_reply(out, proto, Reply_kind::RAW, mess);
       break;
     }
     case Query_type::SHOW:
     {
-      std::string mess = client->tree.print();
-      client->queue_send(mess);
+      append_reply(out, proto, Reply_kind::RAW, TREE.print());
       break;
     }
     case Query_type::CREATE:
     {
-      client->tree.insert(cmd->_path);
-      client->queue_send("100 OK\r\n");
+      TREE.insert(cmd._path);
+      log_write({Wal_op::CREATE, cmd._path});
+      append_reply(out, proto, Reply_kind::OK);
       break;
     }
     case Query_type::GET:
     {
-      auto s = client->tree.get(cmd->_path, cmd->_key);
-      std::string mess = s ? *s.value() + "\r\n" : s.error();
-      client->queue_send(mess);
+      auto s = TREE.get(cmd._path, cmd._key);
+      char buf[Leaf_value::TEXT_MAX];
+      if (s)
+        append_reply(out, proto, Reply_kind::VALUE, s->text(buf));
+      else
+        append_reply(out, proto, Reply_kind::ERROR, s.error());
       break;
     }
     case Query_type::PUT:
     {
-      auto s = client->tree.set(cmd->_path, cmd->_key, cmd->_value);
-      std::string mess = s ? "100 OK\r\n" : s.error();
-      client->queue_send(mess);
+      uint32_t expiry = cmd._ttl ? coarse_clock::deadline(cmd._ttl) : 0;
+      auto s = TREE.set(cmd._path, cmd._key, cmd._value, expiry);
+      if (s && expiry)
+        TIMERS.schedule(expiry, coarse_clock::seconds(), cmd._path, cmd._key);
+      if (s)
+      {
+        log_write({Wal_op::PUT, cmd._path, cmd._key, *s, expiry});
+        append_reply(out, proto, Reply_kind::OK);
+      }
+      else
+        append_reply(out, proto, Reply_kind::ERROR, s.error());
       break;
     }
-    case Query_type::INVALID:
-    default:
+    case Query_type::EXPIRE:
     {
-      client->queue_send("Invalid command\r\n");
+      uint32_t expiry = coarse_clock::deadline(cmd._ttl);
+      auto s = TREE.expire(cmd._path, expiry);
+      if (s)
+      {
+        TIMERS.schedule(expiry, coarse_clock::seconds(), cmd._path, {});
+        log_write({Wal_op::EXPIRE, cmd._path, {}, std::string_view{}, expiry});
+        append_reply(out, proto, Reply_kind::OK);
+      }
+      else
+        append_reply(out, proto, Reply_kind::ERROR, s.error());
+      break;
+    }
+    case Query_type::DEL:
+    {
+      auto s = TREE.erase(cmd._path, cmd._key);
+      if (s)
+      {
+        log_write({Wal_op::DEL, cmd._path, cmd._key});
+        append_reply(out, proto, Reply_kind::OK);
+      }
+      else
+        append_reply(out, proto, Reply_kind::ERROR, s.error());
       break;
     }
+    case Query_type::RMTREE:
+    {
+      // Only unlinks, the reactor loop destroys the subtree a slice at a time
+      if (TREE.remove(cmd._path))
+      {
+        log_write({Wal_op::RMTREE, cmd._path});
+        append_reply(out, proto, Reply_kind::OK);
+      }
+      else
+        append_reply(out, proto, Reply_kind::ERROR, "Couldn't remove subtree because no node at that path exists");
+      break;
+    }
+    case Query_type::INCR:
+    case Query_type::DECR:
+    {
+      // No delta means 1, the delta is parsed here so a bad one never reaches the tree
+      auto delta = cmd._value.empty() ? Leaf_value(int64_t{1}) : Leaf_value::parse_number(cmd._value);
+      if (!delta)
+      {
+        append_reply(out, proto, Reply_kind::ERROR, "Delta is not a number");
+        break;
+      }
+      if (cmd._type == Query_type::DECR)
+      {
+        if (delta->type() == Leaf_value::Type::DOUBLE)
+          delta = Leaf_value(-delta->as_double());
+        else if (delta->as_int() != INT64_MIN)
+          delta = Leaf_value(-delta->as_int());
+        else
+        {
+          append_reply(out, proto, Reply_kind::ERROR, "Delta is out of range");
+          break;
+        }
+      }
+
+      auto s = TREE.incr(cmd._path, cmd._key, *delta);
+      // Logged as the value it came to, with the deadline the key kept, so replay never adds anything twice
+      if (s && WAL)
+        log_write({Wal_op::PUT, cmd._path, cmd._key, *s, TREE.deadline(cmd._path, cmd._key).value_or(0)});
+      char buf[Leaf_value::TEXT_MAX];
+      if (s)
+        append_reply(out, proto, Reply_kind::VALUE, s->text(buf));
+      else
+        append_reply(out, proto, Reply_kind::ERROR, s.error());
+      break;
+    }
+    case Query_type::STATS:
+    {
+      auto s = TREE.stats(cmd._path);
+      if (s)
+        append_reply(out, proto, Reply_kind::VALUE,
+                     std::format("size={} capacity={} load={:.3f} max_probe={} avg_probe={:.2f} rehashes={} bytes={} "
+                                 "shard_bytes={} evicted={}",
+                                 s->size, s->capacity, s->load_factor, s->max_probe, s->avg_probe, s->rehashes,
+                                 s->bytes, TREE.bytes(), TREE.evicted()));
+      else
+        append_reply(out, proto, Reply_kind::ERROR, s.error());
+      break;
+    }
+    case Query_type::SAVE:
+    {
+      // Every reactor writes its shard in the background, the reply does not wait for it
+      auto s = start_save();
+      if (s)
+        append_reply(out, proto, Reply_kind::OK);
+      else
+        append_reply(out, proto, Reply_kind::ERROR, s.error());
+      break;
+    }
+    case Query_type::TOO_LARGE:
+      append_reply(out, proto, Reply_kind::ERROR, "Request too large");
+      break;
+    case Query_type::INVALID:
+    default:
+      append_reply(out, proto, Reply_kind::ERROR, "Invalid command");
+      break;
   };
 }
 
+// -- Reactors ----------------------------------------------------------------------------------------------------------
+//
+// With --threads N the keyspace is split into N shards by hashing the top-level path component. Each reactor thread
+// owns one shard and its own epoll fd and listening socket (SO_REUSEPORT). A query for another shard is posted as a
+// Shard_call to the owner through a lock-free SPSC mailbox, executed there, and posted back. The client coroutine stays
+// suspended meanwhile, so replies keep request order.
+
+constexpr std::size_t MAILBOX_CAPACITY = 256;
+
+struct Shard_call;
+
+struct Reactor
+{
+  int wake_fd = -1; ///< eventfd, signalled after posting into one of our mailboxes
+  std::vector<std::unique_ptr<Spsc_ring<Shard_call *, MAILBOX_CAPACITY>>> mailboxes; ///< mailboxes[from]
+};
+
+// Set up by run_reactors() before any reactor thread starts, read only afterwards.
+std::vector<Reactor> REACTORS;
+
+thread_local std::size_t SHARD = 0;
+thread_local std::vector<bool> PENDING_WAKE;
+thread_local std::vector<std::pair<std::size_t, Shard_call *>> MAILBOX_BACKLOG; // posts that found a full mailbox
+
+struct Mailbox_waker
+{
+  int wake_fd;
+  int shard;
+  Event_type event_type = Event_type::WAKE;
+};
+
+// Same layout as Mailbox_waker, signalled by the log thread after each sync
+struct Wal_waker
+{
+  int sync_fd;
+  int shard;
+  Event_type event_type = Event_type::SYNCED;
+};
+
+std::size_t shard_count() { return REACTORS.empty() ? 1 : REACTORS.size(); }
+
+std::size_t shard_of(std::string_view path)
+{
+  if (REACTORS.size() <= 1)
+    return 0;
+
+  std::size_t begin = path.find_first_not_of('/');
+  if (begin == std::string_view::npos)
+    return 0;  // Root
+  std::size_t end = path.find('/', begin);
+  std::string_view top = path.substr(begin, end == std::string_view::npos ? end : end - begin);
+  return std::hash<std::string_view>{}(top) % REACTORS.size();
+}
+
+struct Shard_call
+{
+  Client *client;
+  const Query *query; ///< Views into the origin client's read buffer, which stays untouched while we are suspended
+  Protocol proto;
+  std::size_t target;
+  std::size_t from = SHARD;
+  bool done = false;
+  std::string reply;
+  std::coroutine_handle<> handle;
+
+  bool await_ready() const noexcept { return false; }
+  void await_suspend(std::coroutine_handle<> h);
+  std::string await_resume() { return std::move(reply); }
+};
+
+void post(std::size_t to, Shard_call *call)
+{
+  if (!MAILBOX_BACKLOG.empty() || !REACTORS[to].mailboxes[SHARD]->push(call))
+    MAILBOX_BACKLOG.emplace_back(to, call);
+  PENDING_WAKE[to] = true;
+}
+
+void Shard_call::await_suspend(std::coroutine_handle<> h)
+{
+  handle = h;
+  post(target, this);
+}
+
+// Retries backlogged posts and wakes every reactor we posted to during this loop iteration.
+void flush_mailboxes()
+{
+  std::size_t kept = 0;
+  for (auto &[to, call] : MAILBOX_BACKLOG)
+  {
+    // Keep order per mailbox, once one post is stuck everything after it for that target waits too
+    bool blocked = false;
+    for (std::size_t i = 0; i < kept; ++i) blocked |= MAILBOX_BACKLOG[i].first == to;
+    if (blocked || !REACTORS[to].mailboxes[SHARD]->push(call))
+      MAILBOX_BACKLOG[kept++] = {to, call};
+  }
+  MAILBOX_BACKLOG.resize(kept);
+
+  for (std::size_t to = 0; to < PENDING_WAKE.size(); ++to)
+  {
+    if (!PENDING_WAKE[to])
+      continue;
+    PENDING_WAKE[to] = false;
+    uint64_t one = 1;
+    [[maybe_unused]] ssize_t n = write(REACTORS[to].wake_fd, &one, sizeof(one));
+  }
+}
+
 void cleanup_client(Client *client)
 {
   if (!client)
@@ -631,21 +717,222 @@ void cleanup_client(Client *client)
   delete client;
 }
 
+// Tears down a client whose read task has finished.
+void finish_client(Client *client)
+{
+  std::println("Cleaning reading task and client: {}:{} fd= {}.", client->addr, client->port, client->fd);
+  if (client->read_task) delete client->read_task;
+  client->read_task = nullptr;
+  cleanup_client(client);
+}
+
+// With --fsync always a reply to a write goes out only once the batch holding the write is on disk. A client waits in
+// a Wal_commit before flushing its replies, a call from another shard waits here before it is posted back.
+struct Wal_wait
+{
+  uint64_t batch; // 0 while the records are still in WAL_BATCH
+  Client *client;
+  std::coroutine_handle<> handle;
+  Shard_call *call;
+};
+
+thread_local std::vector<Wal_wait> WAL_WAITS;
+
+bool durable_replies() { return WAL && WAL->policy() == Fsync_policy::ALWAYS; }
+
+// Batch that holds every record appended so far, 0 if some are not written yet
+uint64_t pending_batch() { return WAL_BATCH.empty() ? WAL_LAST_BATCH : 0; }
+
+struct Wal_commit
+{
+  Client *client;
+
+  bool await_ready() const noexcept { return pending_batch() != 0 && WAL->synced() >= pending_batch(); }
+  void await_suspend(std::coroutine_handle<> h) { WAL_WAITS.push_back({pending_batch(), client, h, nullptr}); }
+  void await_resume() {}
+};
+
+// Writes the records of this loop iteration, everything waiting on them now waits for that batch to be synced
+void write_wal_batch()
+{
+  WAL_LAST_BATCH = WAL->write(WAL_BATCH);
+  WAL_BATCH.clear();
+  for (auto &w : WAL_WAITS)
+    if (w.batch == 0)
+      w.batch = WAL_LAST_BATCH;
+}
+
+// Releases the replies whose batch the log thread has synced, called when it signals `sync_fd`
+void release_wal_waits(int sync_fd)
+{
+  uint64_t count;
+  [[maybe_unused]] ssize_t n = read(sync_fd, &count, sizeof(count));
+
+  uint64_t synced = WAL->synced();
+  std::vector<Wal_wait> ready;
+  std::erase_if(WAL_WAITS, [&](const Wal_wait &w) {
+    if (w.batch == 0 || w.batch > synced)
+      return false;
+    ready.push_back(w);
+    return true;
+  });
+
+  for (auto &w : ready)
+  {
+    if (w.call)
+    {
+      post(w.call->from, w.call);
+      continue;
+    }
+    w.handle.resume();
+    if (w.handle.done())
+      finish_client(w.client);
+  }
+}
+
+// Executes calls posted to this reactor and resumes clients whose calls came back.
+void drain_mailboxes(int wake_fd)
+{
+  uint64_t count;
+  [[maybe_unused]] ssize_t n = read(wake_fd, &count, sizeof(count));
+
+  auto &mailboxes = REACTORS[SHARD].mailboxes;
+  for (std::size_t from = 0; from < mailboxes.size(); ++from)
+  {
+    Shard_call *call;
+    while (mailboxes[from]->pop(call))
+    {
+      if (!call->done)
+      {
+        uint64_t logged = WAL_RECORDS;
+        execute_query(*call->query, call->proto, call->reply);
+        call->done = true;
+        if (WAL_RECORDS != logged && durable_replies())
+          WAL_WAITS.push_back({0, nullptr, {}, call});
+        else
+          post(call->from, call);
+        continue;
+      }
+
+      // Our own call came back, `call` lives in the client's coroutine frame and is gone after resuming
+      Client *client = call->client;
+      std::coroutine_handle<> handle = call->handle;
+      handle.resume();
+      if (handle.done())
+        finish_client(client);
+    }
+  }
+}
+
 Async_task client_read(Client *client)
 {
   while (client && client->is_alive)
   {
-    std::string data = co_await Recv_awaitable{client};
-    if (data.empty())
+    if (!co_await Recv_awaitable{client})
     {
       std::print("Client {} disconnected or read error\n", client->fd);
       // Client will be cleaned up when we exit this function
       break;
     }
-    std::print("{}", data);
 
-    // Process command synchronously to avoid race conditions
-    process_command(client, data);
+    if (client->protocol == Protocol::UNKNOWN && !client->read_buf.empty())
+      client->protocol = detect_protocol(client->read_buf[0]);
+    const Protocol proto = client->protocol;
+
+    // A request over the limit is turned down before anything is framed, the rest of the stream is never read
+    size_t pos = 0;
+    uint64_t logged = WAL_RECORDS;
+    bool oversized = request_too_large(client->read_buf, proto);
+    if (oversized)
+      execute_query(Query{Query_type::TOO_LARGE, {}, {}, {}}, proto, client->reply_buf);
+
+    // Run every complete command of the batch, a trailing partial command waits for more bytes
+    while (!oversized)
+    {
+      std::optional<Query> cmd;
+      if (proto == Protocol::BINARY)
+      {
+        if (cmd = parse_frame(client->read_buf, pos); !cmd)
+          break;
+        if (cmd->_type == Query_type::TOO_LARGE)
+        {
+          // Nothing after the frame can be told apart from its body, so this is the last reply
+          execute_query(*cmd, proto, client->reply_buf);
+          oversized = true;
+          break;
+        }
+      }
+      else
+      {
+        auto line = next_line(client->read_buf, pos);
+        if (!line)
+          break;
+        if (line->size() > MAX_REQUEST_SIZE)
+        {
+          execute_query(Query{Query_type::TOO_LARGE, {}, {}, {}}, proto, client->reply_buf);
+          continue;
+        }
+        if (cmd = parse_command(*line); !cmd)
+        {
+          append_reply(client->reply_buf, proto, Reply_kind::ERROR, "Bad command");
+          continue;
+        }
+      }
+
+      if (cmd->_type == Query_type::SHOW && shard_count() > 1)
+      {
+        // Every shard prints its own part of the keyspace
+        for (std::size_t shard = 0; shard < shard_count(); ++shard)
+        {
+          if (shard == SHARD)
+          {
+            execute_query(*cmd, proto, client->reply_buf);
+            continue;
+          }
+          Shard_call call{client, &*cmd, proto, shard};
+          client->reply_buf += co_await call;
+        }
+        continue;
+      }
+
+      std::size_t shard = shard_of(cmd->_path);
+      if (shard == SHARD)
+      {
+        execute_query(*cmd, proto, client->reply_buf);
+        continue;
+      }
+
+      // Awaiting a named call, not a temporary, keeps the reply alive in the coroutine frame
+      Shard_call call{client, &*cmd, proto, shard};
+      client->reply_buf += co_await call;
+    }
+    client->read_buf.erase(0, pos);
+    if (!oversized && request_too_large(client->read_buf, proto))
+    {
+      execute_query(Query{Query_type::TOO_LARGE, {}, {}, {}}, proto, client->reply_buf);
+      oversized = true;
+    }
+    if (oversized)
+      std::string().swap(client->read_buf);
+
+    if (WAL_RECORDS != logged && durable_replies())
+    {
+      Wal_commit commit{client};
+      co_await commit;
+    }
+    client->flush_replies();
+
+    // A client that does not take its replies is not read from either until it does
+    while (client->is_alive && !client->unsent.empty())
+      co_await Send_awaitable{client};
+
+    if (oversized)
+    {
+      std::println("Client {} sent a command over {} bytes, closing", client->fd, MAX_REQUEST_SIZE);
+      break;
+    }
+    if (client->peer_closed)
+      break;
   }
   co_return;
 }
@@ -653,7 +940,8 @@ Async_task client_read(Client *client)
 Async_task accept_clients(int epfd, int listen_fd)
 {
   Accept_awaitable acceptor = Accept_awaitable{listen_fd, epfd};
-  add_to_epoll(epfd, listen_fd, EPOLLIN | EPOLLET, &acceptor);
+  // Level triggered: one accept per wakeup, pending connections keep the socket readable
+  add_to_epoll(epfd, listen_fd, EPOLLIN, &acceptor);
 
   while (true)
   {
@@ -663,20 +951,14 @@ Async_task accept_clients(int epfd, int listen_fd)
 
     // Create client on heap properly
     Client *client = new Client{.fd = client_data.fd,
-                                .tree = {},
                                 .epfd = epfd,
                                 .port = client_data.port,
                                 .addr = client_data.addr,
-                                .is_sending = false,
-                                .send_queue = {},
-                                .is_alive = true,
-                                .current_send_data = {},
-                                .current_send_offset = 0,
-                                .send_task = std::nullopt };
+                                .is_alive = true };
     CLIENTS[client->fd] = client;
 
     std::string mess = "100 connected Ok\r\n";
-    send(client->fd, mess.data(), mess.length(), 0);
+    send(client->fd, mess.data(), mess.length(), MSG_NOSIGNAL);
 
     add_to_epoll(epfd, client->fd, EPOLLIN | EPOLLET | EPOLLONESHOT, nullptr);
     client->read_task = new Async_task(client_read(client));
@@ -684,21 +966,381 @@ Async_task accept_clients(int epfd, int listen_fd)
   co_return;
 }
 
+// The log as every reactor reads it at startup. The reactors first go through it together, a chunk at a time, each
+// sorting the records of its chunks out by shard; then each applies the records of its own shard, in log order.
+struct Log_split
+{
+  std::shared_ptr<const Wal_records> records;
+  std::atomic<std::size_t> next_chunk{0};
+  std::atomic<std::size_t> read{0};
+  std::vector<std::vector<std::vector<uint32_t>>> owned; ///< owned[chunk][shard], offsets of the shard's records
+  std::latch sorted;
+  std::atomic<std::size_t> shards_left;
+
+  Log_split(std::shared_ptr<const Wal_records> all, std::size_t shards)
+    : records(std::move(all)), owned(records->chunk_count(), std::vector<std::vector<uint32_t>>(shards)),
+      sorted(static_cast<std::ptrdiff_t>(shards)), shards_left(shards)
+  {}
+};
+
+std::unique_ptr<Log_split> LOG_SPLIT;
+
+// Applies this shard's records of the log. Runs before the loop starts, so nothing is served from a partial tree.
+void replay_wal()
+{
+  std::size_t applied = 0;
+  auto apply = [&](const Wal_record &r) {
+    ++applied;
+    switch (r.op)
+    {
+      case Wal_op::CREATE: TREE.insert(r.path); break;
+      case Wal_op::PUT:
+        if (TREE.set(r.path, r.key, r.value, r.deadline) && r.deadline)
+          TIMERS.schedule(r.deadline, coarse_clock::seconds(), r.path, r.key);
+        break;
+      case Wal_op::DEL: (void)TREE.erase(r.path, r.key); break;
+      case Wal_op::RMTREE: TREE.remove(r.path); break;
+      case Wal_op::EXPIRE:
+        if (TREE.expire(r.path, r.deadline))
+          TIMERS.schedule(r.deadline, coarse_clock::seconds(), r.path, {});
+        break;
+    }
+    // Removed subtrees go as they come, a log that builds and drops big trees must not pile them all up
+    if (TREE.has_garbage())
+      TREE.collect(COLLECT_BUDGET);
+  };
+
+  if (!LOG_SPLIT)
+  {
+    std::size_t read = WAL->replay(apply);
+    std::println("Shard {}: replayed {} of {} log records", SHARD, applied, read);
+    return;
+  }
+
+  Log_split &split = *LOG_SPLIT;
+  for (std::size_t c; (c = split.next_chunk.fetch_add(1, std::memory_order_relaxed)) < split.owned.size();)
+  {
+    std::size_t read = 0;
+    split.records->read_chunk(c, [&](uint32_t offset, const Wal_record &r) {
+      split.owned[c][shard_of(r.path)].push_back(offset);
+      ++read;
+    });
+    split.read.fetch_add(read, std::memory_order_relaxed);
+  }
+  split.sorted.arrive_and_wait();
+
+  for (std::size_t c = 0; c < split.owned.size(); ++c)
+  {
+    for (uint32_t offset : split.owned[c][SHARD]) apply(split.records->at(c, offset));
+    std::vector<uint32_t>().swap(split.owned[c][SHARD]);
+  }
+  std::println("Shard {}: replayed {} of {} log records", SHARD, applied, split.read.load(std::memory_order_relaxed));
+
+  // The last one out unmaps the log
+  if (split.shards_left.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    LOG_SPLIT.reset();
+}
+
+// -- Snapshots ---------------------------------------------------------------------------------------------------------
+//
+// A save runs on every reactor at once, each writing its own shard into the same file a slice per loop iteration, with
+// no fork and no pause. The tree writes a node out before changing one the save has not reached yet, so the file holds
+// each shard as it was when its reactor began. A background thread then lays the blocks out as an image (image.hpp),
+// which the next start maps and serves as it is. The log is rotated as the save starts and the rotated part dropped
+// once the image is on disk. Records written between the rotation and a reactor beginning are in both, replaying them
+// on top of the snapshot changes nothing.
+
+// Units of Tree::save() per loop iteration
+constexpr std::size_t SAVE_BUDGET = 4096;
+
+struct Save_job
+{
+  int fd = -1;  // Blocks of every shard, laid out as an image over the snapshot once all are in
+  std::string tmp;
+  std::atomic<std::size_t> shards_left{0};
+  std::atomic<bool> failed{false};
+};
+
+std::mutex SAVE_MUTEX;
+std::shared_ptr<Save_job> SAVE_JOB;          // Running save, under SAVE_MUTEX
+std::atomic<uint64_t> SAVE_GENERATION{0};   // Bumped by every save started
+
+thread_local uint64_t SAVE_SEEN = 0;        // Last generation this reactor looked at
+thread_local std::shared_ptr<Save_job> SAVE; // Save this reactor is writing its shard into
+thread_local Snapshot_writer SAVE_OUT;
+thread_local uint32_t NEXT_SAVE = 0;        // Unix second of the next periodic save, shard 0 only
+
+std::expected<void, std::string> start_save()
+{
+  if (SNAPSHOT_PATH.empty())
+    return std::unexpected("Snapshots are off, start the server with --snapshot <file>");
+
+  std::lock_guard lock(SAVE_MUTEX);
+  if (SAVE_JOB)
+    return std::unexpected("A save is already running");
+
+  std::string tmp = SNAPSHOT_PATH + ".part";
+  int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+  if (fd == -1)
+    return std::unexpected(std::format("Couldn't create {}: {}", tmp, std::strerror(errno)));
+  if (write(fd, SNAPSHOT_MAGIC.data(), SNAPSHOT_MAGIC.size()) != static_cast<ssize_t>(SNAPSHOT_MAGIC.size()))
+  {
+    close(fd);
+    unlink(tmp.c_str());
+    return std::unexpected(std::format("Couldn't write {}: {}", tmp, std::strerror(errno)));
+  }
+  if (WAL)
+    if (auto rotated = WAL->rotate(); !rotated)
+    {
+      close(fd);
+      unlink(tmp.c_str());
+      return std::unexpected(rotated.error());
+    }
+
+  auto job = std::make_shared<Save_job>();
+  job->fd = fd;
+  job->tmp = std::move(tmp);
+  job->shards_left = shard_count();
+  SAVE_JOB = job;
+  SAVE_GENERATION.fetch_add(1, std::memory_order_release);
+
+  // Idle reactors would not notice until their next event
+  for (auto &reactor : REACTORS)
+  {
+    uint64_t one = 1;
+    [[maybe_unused]] ssize_t n = write(reactor.wake_fd, &one, sizeof(one));
+  }
+  return {};
+}
+
+// Read-only mapping of a whole file. `error` is set, and the view empty, if it cannot be opened or mapped.
+struct Mapped_file
+{
+  const char *data = nullptr;
+  std::size_t size = 0;
+  int error = 0;
+
+  explicit Mapped_file(const std::string &path)
+  {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st{};
+    if (fd == -1 || fstat(fd, &st) == -1)
+    {
+      error = errno;
+      if (fd != -1)
+        close(fd);
+      return;
+    }
+    if (st.st_size != 0)
+    {
+      void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p == MAP_FAILED)
+        error = errno;
+      else
+      {
+        madvise(p, st.st_size, MADV_SEQUENTIAL);
+        data = static_cast<const char *>(p);
+        size = st.st_size;
+      }
+    }
+    close(fd);
+  }
+  ~Mapped_file()
+  {
+    if (data)
+      munmap(const_cast<char *>(data), size);
+  }
+  Mapped_file(const Mapped_file &) = delete;
+  Mapped_file &operator=(const Mapped_file &) = delete;
+
+  std::string_view view() const { return {data, size}; }
+};
+
+// Runs once the last shard is in the file. Laying the blocks out as an image, syncing and renaming all block, so it is
+// done off the reactors.
+void finish_save(std::shared_ptr<Save_job> job)
+{
+  std::thread([job = std::move(job)] {
+    close(job->fd);
+    bool ok = !job->failed;
+    if (ok)
+    {
+      Mapped_file blocks(job->tmp);
+      auto written = blocks.error ? std::unexpected(std::format("Couldn't map {}: {}", job->tmp, std::strerror(blocks.error)))
+                                  : write_image(blocks.view(), SNAPSHOT_PATH);
+      if (!written)
+        std::println("{}", written.error());
+      ok = written.has_value();
+    }
+    unlink(job->tmp.c_str());
+
+    if (ok)
+    {
+      // The rename is only durable once the directory is synced, the rotated log must outlive it
+      auto dir = std::filesystem::path(SNAPSHOT_PATH).parent_path();
+      if (int dfd = open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC); dfd != -1)
+      {
+        fsync(dfd);
+        close(dfd);
+      }
+      if (WAL)
+        WAL->drop_rotated();
+      std::println("Snapshot saved to {}", SNAPSHOT_PATH);
+    }
+    else
+      std::println("Saving snapshot {} failed, the previous one stays", SNAPSHOT_PATH);
+
+    std::lock_guard lock(SAVE_MUTEX);
+    SAVE_JOB.reset();
+  }).detach();
+}
+
+// Writes the next slice of this shard into the running save, joining a save that just started
+void step_save()
+{
+  if (!SAVE)
+  {
+    uint64_t generation = SAVE_GENERATION.load(std::memory_order_acquire);
+    if (generation == SAVE_SEEN)
+      return;
+    SAVE_SEEN = generation;
+    {
+      std::lock_guard lock(SAVE_MUTEX);
+      SAVE = SAVE_JOB;
+    }
+    if (!SAVE)
+      return;
+    TREE.begin_save(SAVE_OUT);
+  }
+
+  bool more = TREE.save(SAVE_BUDGET);
+  std::string &out = SAVE_OUT.output();
+  // One write per slice, O_APPEND keeps the blocks of different shards whole
+  if (!out.empty() && !SAVE->failed && write(SAVE->fd, out.data(), out.size()) != static_cast<ssize_t>(out.size()))
+  {
+    std::println("Shard {}: writing snapshot failed: {}", SHARD, std::strerror(errno));
+    SAVE->failed = true;
+  }
+  out.clear();
+  if (more)
+    return;
+
+  if (SAVE->shards_left.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    finish_save(std::move(SAVE));
+  SAVE.reset();
+}
+
+// Serves this shard's part of an image from the mapping, only its nodes are built
+void mount_image()
+{
+  auto image = Image::open(SNAPSHOT_PATH);
+  __assert(image.has_value(), image.error());
+
+  auto deadlines = TREE.mount(std::move(*image), [](std::string_view top) { return shard_of(top) == SHARD; });
+  for (auto &[path, deadline] : deadlines)
+    TIMERS.schedule(deadline, coarse_clock::seconds(), path, {});
+  std::println("Shard {}: mounted {} nodes from {}, {} of them serving entries from it", SHARD, TREE.node_count(),
+               SNAPSHOT_PATH, TREE.image_nodes());
+}
+
+// Loads this shard's nodes and entries from a snapshot left as blocks, entry by entry
+void load_blocks(std::string_view buf)
+{
+  // Node deadlines are set once every node is in, an expired parent would hide its children from insert()
+  std::string path;
+  bool mine = false;
+  std::size_t entries = 0;
+  std::vector<std::pair<std::string, uint32_t>> deadlines;
+  auto node = [&](std::span<const std::string_view> components, uint32_t deadline) {
+    path.clear();
+    for (auto c : components) path.append("/").append(c);
+    mine = shard_of(path) == SHARD;
+    if (!mine)
+      return;
+    TREE.insert(path);
+    if (deadline)
+      deadlines.emplace_back(path, deadline);
+  };
+  auto leaf = [&](std::string_view key, const Leaf_value &value, uint32_t deadline) {
+    if (!mine || coarse_clock::expired(deadline))
+      return;
+    if (TREE.set(path, key, value, deadline) && deadline)
+      TIMERS.schedule(deadline, coarse_clock::seconds(), path, key);
+    ++entries;
+  };
+
+  for (std::size_t pos = SNAPSHOT_MAGIC.size(); pos < buf.size();)
+  {
+    auto body = next_block(buf, pos);
+    __assert(body && decode_block(*body, node, leaf), std::format("Snapshot {} is corrupt at byte {}", SNAPSHOT_PATH, pos));
+  }
+
+  for (auto &[node_path, deadline] : deadlines)
+    if (TREE.expire(node_path, deadline))
+      TIMERS.schedule(deadline, coarse_clock::seconds(), node_path, {});
+  std::println("Shard {}: loaded {} nodes and {} entries from {}", SHARD, TREE.node_count(), entries, SNAPSHOT_PATH);
+}
+
+// Loads this shard's part of the snapshot file, before the log is replayed on top of it
+void load_snapshot()
+{
+  Mapped_file file(SNAPSHOT_PATH);
+  if (file.error == ENOENT)
+    return;
+  __assert(file.error == 0, std::format("Couldn't map snapshot {}: {}", SNAPSHOT_PATH, std::strerror(file.error)));
+
+  if (file.view().starts_with(IMAGE_MAGIC))
+    return mount_image();
+  __assert(file.view().starts_with(SNAPSHOT_MAGIC), std::format("{} is not a snapshot", SNAPSHOT_PATH));
+  load_blocks(file.view());
+}
+
 void run_server(int server_fd)
 {
   int epfd = epoll_create1(0);
   __assert(epfd != -1, std::format("epoll_create1 failed: {}", std::strerror(errno)));
 
-  static Async_task accept_coroutine = accept_clients(epfd, server_fd);
-  accept_coroutine.resume();
+  // Runs up to its first co_await and then waits for the listening socket to become readable
+  Async_task accept_coroutine = accept_clients(epfd, server_fd);
+
+  Mailbox_waker waker{-1, static_cast<int>(SHARD)};
+  if (!REACTORS.empty())
+  {
+    waker.wake_fd = REACTORS[SHARD].wake_fd;
+    PENDING_WAKE.assign(REACTORS.size(), false);
+    add_to_epoll(epfd, waker.wake_fd, EPOLLIN, &waker);
+  }
+
+  Wal_waker sync_waker{-1, static_cast<int>(SHARD)};
+  if (durable_replies())
+  {
+    sync_waker.sync_fd = eventfd(0, EFD_NONBLOCK);
+    __assert(sync_waker.sync_fd != -1, std::format("eventfd failed: {}", std::strerror(errno)));
+    WAL->listen(sync_waker.sync_fd);
+    add_to_epoll(epfd, sync_waker.sync_fd, EPOLLIN, &sync_waker);
+  }
 
   constexpr int MAX_EVENTS = 64;
   epoll_event events[MAX_EVENTS];
 
+  coarse_clock::update();
+  if (!SNAPSHOT_PATH.empty())
+    load_snapshot();
+  if (WAL)
+    replay_wal();
   while (true)
   {
-    int num_events = epoll_wait(epfd, events, MAX_EVENTS, -1);
+    // Sleep until the next second while deadlines or periodic saves are pending, and not at all while reaping,
+    // teardown or a save is behind
+    int timeout = -1;
+    if (!MAILBOX_BACKLOG.empty() || TIMERS.busy(coarse_clock::seconds()) || TREE.has_garbage() || TREE.saving())
+      timeout = 0;
+    else if (!TIMERS.empty() || (SAVE_EVERY && SHARD == 0))
+      timeout = coarse_clock::until_next_second();
+
+    int num_events = epoll_wait(epfd, events, MAX_EVENTS, timeout);
     __assert(num_events >= 0, std::format("epoll_wait failed: {}", std::strerror(errno)));
+    coarse_clock::update();
 
     for (int i = 0; i < num_events; ++i)
     {
@@ -716,6 +1358,18 @@ void run_server(int server_fd)
         continue;
       }
 
+      if (auto *wake = static_cast<Mailbox_waker *>(ptr); wake->event_type == Event_type::WAKE)
+      {
+        drain_mailboxes(wake->wake_fd);
+        continue;
+      }
+
+      if (auto *sync = static_cast<Wal_waker *>(ptr); sync->event_type == Event_type::SYNCED)
+      {
+        release_wal_waits(sync->sync_fd);
+        continue;
+      }
+
       // Check for read events
       if (auto *recv = static_cast<Recv_awaitable *>(ptr); recv->event_type == Event_type::READ)
       {
@@ -723,12 +1377,7 @@ void run_server(int server_fd)
         if (recv->client && CLIENTS.count(recv->client->fd) && CLIENTS[recv->client->fd] == recv->client)
           recv->resume();
         if (recv->handle.done())
-        {
-          std::println("Cleaning reading task and client: {}:{} fd= {}.", recv->client->addr, recv->client->port, recv->client->fd);
-          if (recv->client->read_task) delete recv->client->read_task;
-          recv->client->read_task = nullptr;
-          cleanup_client(recv->client);
-        }
+          finish_client(recv->client);
         continue;
       }
 
@@ -739,11 +1388,74 @@ void run_server(int server_fd)
         if (send_awaitable->client && CLIENTS.count(send_awaitable->client->fd) &&
             CLIENTS[send_awaitable->client->fd] == send_awaitable->client)
         {
-          send_awaitable->resume();
+          // Resumes the client's read loop, which may end here
+          Client *client = send_awaitable->client;
+          std::coroutine_handle<> handle = send_awaitable->handle;
+          handle.resume();
+          if (handle.done())
+            finish_client(client);
         }
         continue;
       }
 
     }
+
+    // One write for everything this iteration changed
+    if (!WAL_BATCH.empty())
+      write_wal_batch();
+
+    if (!REACTORS.empty())
+      flush_mailboxes();
+
+    auto reap = [](std::string_view path, std::string_view key, uint32_t deadline) {
+      if (TREE.reap(path, key))
+        return;
+      // The wheel keeps the earliest hint of a key, a later write may have moved its deadline on since
+      uint32_t stored = 0;
+      if (!key.empty())
+        stored = TREE.deadline(path, key).value_or(0);
+      else if (auto node = TREE.find(path))
+        stored = (*node)->_expiry;
+      if (stored > deadline)
+        TIMERS.schedule(stored, coarse_clock::seconds(), path, key);
+    };
+    TIMERS.advance(coarse_clock::seconds(), EXPIRE_BUDGET, reap);
+    TREE.collect(COLLECT_BUDGET);
+
+    if (SAVE_EVERY && SHARD == 0 && coarse_clock::seconds() >= NEXT_SAVE)
+    {
+      if (NEXT_SAVE != 0)
+        (void)start_save();  // Skipped while a save is still running
+      NEXT_SAVE = coarse_clock::seconds() + SAVE_EVERY;
+    }
+    step_save();
   }
 }
+
+void run_reactors(const Server_options &opts)
+{
+  REACTORS.resize(opts.threads);
+  for (auto &reactor : REACTORS)
+  {
+    reactor.wake_fd = eventfd(0, EFD_NONBLOCK);
+    __assert(reactor.wake_fd != -1, std::format("eventfd failed: {}", std::strerror(errno)));
+    for (std::size_t from = 0; from < opts.threads; ++from)
+      reactor.mailboxes.push_back(std::make_unique<Spsc_ring<Shard_call *, MAILBOX_CAPACITY>>());
+  }
+
+  if (WAL)
+    LOG_SPLIT = std::make_unique<Log_split>(WAL->records(), opts.threads);
+
+  std::vector<std::thread> threads;
+  for (std::size_t shard = 0; shard < opts.threads; ++shard)
+    threads.emplace_back([shard, &opts] {
+      SHARD = shard;
+      // Shards see similar load through the path hash, so each gets an even share of the limit
+      set_shard_max_memory(opts.max_memory / opts.threads);
+      int skt = init_server(opts.port, opts.host, true);
+      run_server(skt);
+      close(skt);
+    });
+
+  for (auto &t : threads) t.join();
+}
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
 #include <sys/socket.h>
 #include <sys/wait.h>
@@ -7,9 +8,39 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+#include <string>
+
+#include "protocol.hpp"
+
 constexpr uint16_t PORT = 9000;
 constexpr const char * HOST = "127.0.0.1";
 
-int init_server(uint16_t _port, const char *_host);
+struct Server_options
+{
+  uint16_t port = PORT;
+  const char *host = HOST;
+  std::size_t threads = 1; ///< Number of reactors, each owning one shard of the keyspace
+  std::size_t max_memory = 0; ///< Bytes all shards together may hold before evicting, 0 for no limit
+};
+
+int init_server(uint16_t _port, const char *_host, bool reuse_port = false);
 
 void run_server(int server_fd);
+
+class Wal;
+
+// Logs every write to `wal` and replays it when a reactor starts. Must be called before any reactor runs, null for no log.
+void set_wal(Wal *wal);
+
+// Loads the snapshot at `path` when a reactor starts, before the log, and saves to it on "save" and every `every`
+// seconds, 0 for only on "save". Must be called before any reactor runs.
+void set_snapshot(const std::string &path, unsigned every);
+
+// Memory limit of the calling reactor's shard, in bytes, 0 for none.
+void set_shard_max_memory(std::size_t bytes);
+
+// Runs a query against the calling reactor's shard and appends the reply, encoded for `proto`, to `out`.
+void execute_query(const Query &cmd, Protocol proto, std::string &out);
+
+// Starts `opts.threads` reactors, each with its own epoll loop and SO_REUSEPORT listening socket. Blocks forever.
+void run_reactors(const Server_options &opts);
@@ -0,0 +1,131 @@
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include "snapshot.hpp"
+
+namespace
+{
+  constexpr size_t HEADER_SIZE = 4 + 4;
+
+  void store_u32(std::string &out, uint32_t v)
+  {
+    char b[sizeof(v)];
+    std::memcpy(b, &v, sizeof(v));
+    out.append(b, sizeof(v));
+  }
+
+  void patch_u32(std::string &out, size_t at, uint32_t v) { std::memcpy(out.data() + at, &v, sizeof(v)); }
+
+  uint32_t checksum(std::string_view s) { return static_cast<uint32_t>(Wyhash{}(s)); }
+}
+
+void Snapshot_writer::node(std::span<const std::string_view> path, uint32_t deadline)
+{
+  close_node();
+  if (_records.size() + _components.size() >= BLOCK_SIZE)
+    seal();
+  _path.assign(path.begin(), path.end());
+  _deadline = deadline;
+  open_node();
+}
+
+void Snapshot_writer::leaf(std::string_view key, const Leaf_value &value, uint32_t deadline)
+{
+  if (_records.size() + _components.size() >= BLOCK_SIZE)
+  {
+    // Carry on with the same node in a fresh block
+    seal();
+    open_node();
+  }
+
+  char buf[sizeof(int64_t)];
+  std::string_view bytes = value.bytes();
+  if (value.type() == Leaf_value::Type::INT)
+  {
+    int64_t i = value.as_int();
+    std::memcpy(buf, &i, sizeof(i));
+    bytes = {buf, sizeof(i)};
+  }
+  else if (value.type() == Leaf_value::Type::DOUBLE)
+  {
+    double d = value.as_double();
+    std::memcpy(buf, &d, sizeof(d));
+    bytes = {buf, sizeof(d)};
+  }
+
+  store_u32(_records, static_cast<uint32_t>(key.size()));
+  _records.append(key);
+  store_u32(_records, deadline);
+  _records.push_back(static_cast<char>(value.type()));
+  store_u32(_records, static_cast<uint32_t>(bytes.size()));
+  _records.append(bytes);
+  ++_leaves;
+}
+
+void Snapshot_writer::seal()
+{
+  close_node();
+  if (_records.empty())
+    return;
+
+  std::string body;
+  body.reserve(sizeof(uint32_t) + _components.size() + _records.size());
+  store_u32(body, _component_count);
+  body.append(_components).append(_records);
+
+  store_u32(_out, static_cast<uint32_t>(body.size()));
+  store_u32(_out, checksum(body));
+  _out.append(body);
+
+  _components.clear();
+  _records.clear();
+  _component_count = 0;
+  _component_ids.clear();
+}
+
+void Snapshot_writer::open_node()
+{
+  store_u32(_records, static_cast<uint32_t>(_path.size()));
+  for (const auto &c : _path)
+  {
+    auto it = _component_ids.find(c);
+    if (it == _component_ids.end())
+    {
+      store_u32(_components, static_cast<uint32_t>(c.size()));
+      _components.append(c);
+      it = _component_ids.emplace(c, _component_count++).first;
+    }
+    store_u32(_records, it->second);
+  }
+  store_u32(_records, _deadline);
+  _count_at = _records.size();
+  store_u32(_records, 0);
+  _leaves = 0;
+}
+
+void Snapshot_writer::close_node()
+{
+  if (_count_at == SIZE_MAX)
+    return;
+  patch_u32(_records, _count_at, _leaves);
+  _count_at = SIZE_MAX;
+}
+
+std::optional<std::string_view> next_block(std::string_view buf, size_t &pos)
+{
+  if (buf.size() - pos < HEADER_SIZE)
+    return std::nullopt;
+
+  uint32_t body, sum;
+  std::memcpy(&body, buf.data() + pos, sizeof(body));
+  std::memcpy(&sum, buf.data() + pos + 4, sizeof(sum));
+  if (buf.size() - pos - HEADER_SIZE < body)
+    return std::nullopt;
+
+  std::string_view b = buf.substr(pos + HEADER_SIZE, body);
+  if (checksum(b) != sum)
+    return std::nullopt;
+  pos += HEADER_SIZE + body;
+  return b;
+}
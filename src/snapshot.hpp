@@ -0,0 +1,170 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "leaf_map.hpp"
+
+/*
+ * Snapshot file. A magic string followed by self-contained blocks, so any block can be decoded on its own:
+ *
+ *      file       : "DASHSNP1" block*
+ *      block      : [u32 body_len][u32 checksum][body]
+ *      body       : [u32 component_count] component* node*
+ *      component  : [u32 len][bytes]
+ *      node       : [u32 depth][u32 component index]*depth [u32 deadline][u32 leaf_count] leaf*
+ *      leaf       : [u32 key_len][key][u32 deadline][u8 value_type][u32 value_len][value]
+ *
+ * The checksum is the low half of the wyhash of the body. A node is its path, as indexes into the block's table of
+ * path components, its own deadline and its entries. A node too big for one block is continued by records with the
+ * same path in later blocks. Shards append blocks to the same file in any order, the tree is whatever all the
+ * records add up to.
+ */
+
+inline constexpr std::string_view SNAPSHOT_MAGIC = "DASHSNP1";
+
+/**
+ * @brief Encodes node records into blocks.
+ *
+ * Blocks are sealed once they pass `BLOCK_SIZE` bytes, in the middle of a node if need be. Sealed blocks pile up in
+ * output() until the caller writes them out and clears it.
+ */
+class Snapshot_writer
+{
+  static constexpr size_t BLOCK_SIZE = 64 * 1024;
+
+  struct component_hash
+  {
+    using is_transparent = void;
+    size_t operator()(std::string_view s) const noexcept { return Wyhash{}(s); }
+  };
+
+  std::string _out;
+  std::string _components;
+  std::string _records;
+  uint32_t _component_count = 0;
+  std::unordered_map<std::string, uint32_t, component_hash, std::equal_to<>> _component_ids;
+
+  std::vector<std::string> _path; ///< Node being written, to continue it in the next block
+  uint32_t _deadline = 0;
+  size_t _count_at = SIZE_MAX;    ///< Offset of the open node's leaf count in _records, SIZE_MAX if none is open
+  uint32_t _leaves = 0;
+
+public:
+  /// Starts the record of the node at `path`, given as its components from the root down
+  void node(std::span<const std::string_view> path, uint32_t deadline);
+
+  /// Adds an entry to the open node
+  void leaf(std::string_view key, const Leaf_value &value, uint32_t deadline);
+
+  /// Seals the open block, if it holds anything
+  void seal();
+
+  /// Sealed blocks, ready to be written
+  std::string &output() { return _out; }
+
+private:
+  void open_node();
+  void close_node();
+};
+
+// Finds the block starting at buf[pos] and advances `pos` past it. Returns its body, or std::nullopt and leaves `pos`
+// alone if the block is cut short or fails its checksum.
+std::optional<std::string_view> next_block(std::string_view buf, size_t &pos);
+
+/**
+ * @brief Decodes a block body, calling `node(path, deadline)` for each node record, `path` being a span of its
+ * components, then `leaf(key, value, deadline)` for each of its entries.
+ *
+ * @return False if the body is malformed
+ */
+template <typename N, typename L>
+bool decode_block(std::string_view body, N &&node, L &&leaf)
+{
+  size_t pos = 0;
+  auto u32 = [&](uint32_t &v) {
+    if (body.size() - pos < sizeof(v))
+      return false;
+    std::memcpy(&v, body.data() + pos, sizeof(v));
+    pos += sizeof(v);
+    return true;
+  };
+  auto bytes = [&](std::string_view &s) {
+    uint32_t len;
+    if (!u32(len) || body.size() - pos < len)
+      return false;
+    s = body.substr(pos, len);
+    pos += len;
+    return true;
+  };
+
+  uint32_t count;
+  if (!u32(count) || count > body.size())
+    return false;
+  std::vector<std::string_view> components(count);
+  for (auto &c : components)
+    if (!bytes(c))
+      return false;
+
+  std::vector<std::string_view> path;
+  while (pos < body.size())
+  {
+    uint32_t depth, deadline, leaves;
+    if (!u32(depth) || depth > body.size())
+      return false;
+    path.resize(depth);
+    for (auto &c : path)
+    {
+      uint32_t idx;
+      if (!u32(idx) || idx >= components.size())
+        return false;
+      c = components[idx];
+    }
+    if (!u32(deadline) || !u32(leaves))
+      return false;
+    node(std::span<const std::string_view>(path), deadline);
+
+    for (uint32_t i = 0; i < leaves; ++i)
+    {
+      std::string_view key, value;
+      uint32_t expiry;
+      if (!bytes(key) || !u32(expiry) || pos == body.size())
+        return false;
+      auto type = static_cast<Leaf_value::Type>(body[pos++]);
+      if (!bytes(value))
+        return false;
+
+      switch (type)
+      {
+        case Leaf_value::Type::BYTES: leaf(key, Leaf_value(value), expiry); break;
+        case Leaf_value::Type::INT:
+        {
+          int64_t v;
+          if (value.size() != sizeof(v))
+            return false;
+          std::memcpy(&v, value.data(), sizeof(v));
+          leaf(key, Leaf_value(v), expiry);
+          break;
+        }
+        case Leaf_value::Type::DOUBLE:
+        {
+          double v;
+          if (value.size() != sizeof(v))
+            return false;
+          std::memcpy(&v, value.data(), sizeof(v));
+          leaf(key, Leaf_value(v), expiry);
+          break;
+        }
+        default: return false;
+      }
+    }
+  }
+  return true;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <new>
+
+/**
+ * @brief Bounded lock-free single-producer / single-consumer ring buffer.
+ *
+ * Exactly one thread may call push() and exactly one (possibly other) thread may call pop().
+ * Head and tail live on separate cache lines so producer and consumer do not false-share.
+ *
+ * @tparam T Element type, should be cheap to copy (pointers in practice)
+ * @tparam N Capacity, must be a power of two
+ */
+template <typename T, std::size_t N>
+class Spsc_ring
+{
+  static_assert(N != 0 && (N & (N - 1)) == 0, "Spsc_ring capacity must be a power of two");
+
+  alignas(64) std::atomic<std::size_t> _head{0}; ///< Next slot to pop, written by consumer
+  alignas(64) std::atomic<std::size_t> _tail{0}; ///< Next slot to push, written by producer
+  alignas(64) std::array<T, N> _slots{};
+
+public:
+  /**
+   * @brief Push a value. Producer side only.
+   *
+   * @return false if the ring is full, value is not stored then
+   */
+  bool push(const T &v)
+  {
+    std::size_t tail = _tail.load(std::memory_order_relaxed);
+    if (tail - _head.load(std::memory_order_acquire) == N)
+      return false;
+
+    _slots[tail & (N - 1)] = v;
+    _tail.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * @brief Pop a value. Consumer side only.
+   *
+   * @return false if the ring is empty
+   */
+  bool pop(T &out)
+  {
+    std::size_t head = _head.load(std::memory_order_relaxed);
+    if (head == _tail.load(std::memory_order_acquire))
+      return false;
+
+    out = _slots[head & (N - 1)];
+    _head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+};
@@ -0,0 +1,174 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief Hierarchical timer wheel of expiry deadlines in whole seconds.
+ *
+ * `LEVELS` wheels of `SLOTS` buckets each, level L bucket covering 64^L seconds, so scheduling is O(1) for any
+ * deadline up to 2^36 seconds away. When the lower levels wrap, the matching bucket of the level above is pulled
+ * down and redistributed. advance() is incremental: firing an entry, redistributing one, or stepping one second each
+ * cost one unit of the caller's budget, and whatever is left over carries on at the next call, so a million keys
+ * expiring in the same second never stall the event loop.
+ *
+ * Entries are copies of the path and key, never references into the tree. They are hints: an entry whose key was
+ * rewritten, erased or given a new deadline fires anyway, and the callback checks the deadline actually stored.
+ * A key has at most one live hint, at the earliest deadline it was scheduled for. Scheduling it again for a later
+ * deadline is a no-op, so a key rewritten with a TTL on every write costs one entry, and the callback reschedules it
+ * when the hint fires early. An earlier deadline supersedes the live hint, which is dropped without firing.
+ * Not thread-safe.
+ */
+class Timer_wheel
+{
+  static constexpr size_t BITS = 6;
+  static constexpr size_t SLOTS = size_t{1} << BITS;
+  static constexpr size_t LEVELS = 6;
+
+  struct hint
+  {
+    uint32_t deadline; ///< Of the live entry, 0 while the name has none
+    uint32_t entries;  ///< Entries naming it, superseded ones included
+  };
+
+  // Path followed by key of every scheduled entry. Entries point at their key here, which stays put across rehashes.
+  std::unordered_map<std::string, hint> _hints;
+  std::string _name; ///< Reused to build the name looked up by schedule()
+
+  struct entry
+  {
+    uint32_t deadline;
+    uint32_t path_size;
+    const std::string *name;
+
+    std::string_view path() const { return std::string_view(*name).substr(0, path_size); }
+    std::string_view key() const { return std::string_view(*name).substr(path_size); }
+  };
+
+  std::vector<entry> _wheels[LEVELS][SLOTS];
+  std::vector<entry> _due;                   ///< Deadline reached, waiting to fire
+  std::vector<std::vector<entry>> _pending;  ///< Buckets pulled down a level, waiting to be redistributed
+  uint32_t _current = 0;                     ///< Last second stepped through
+  size_t _size = 0;
+
+public:
+  /**
+   * @brief Fire `path`, `key` at `deadline`, unless it is already due to fire by then. An empty key stands for the
+   * node at `path` itself.
+   */
+  void schedule(uint32_t deadline, uint32_t now, std::string_view path, std::string_view key)
+  {
+    if (_size == 0)
+      _current = now;
+
+    _name.assign(path).append(key);
+    auto [it, added] = _hints.try_emplace(_name, hint{0, 0});
+    if (it->second.deadline != 0 && it->second.deadline <= deadline)
+      return;
+
+    it->second.deadline = deadline;
+    ++it->second.entries;
+    place(entry{deadline, static_cast<uint32_t>(path.size()), &it->first});
+    ++_size;
+  }
+
+  /**
+   * @brief Fire entries due at `now`, calling `fn(path, key, deadline)` for each, spending at most `budget` units.
+   *
+   * @return True if due work is left over for the next call
+   */
+  template <typename F>
+  bool advance(uint32_t now, size_t budget, F &&fn)
+  {
+    if (_size == 0)
+    {
+      _current = now;
+      return false;
+    }
+
+    for (; budget > 0; --budget)
+    {
+      if (!_due.empty())
+      {
+        entry e = _due.back();
+        _due.pop_back();
+        --_size;
+        fire(e, fn);
+      }
+      else if (!_pending.empty())
+      {
+        auto &bucket = _pending.back();
+        entry e = std::move(bucket.back());
+        bucket.pop_back();
+        if (bucket.empty())
+          _pending.pop_back();
+        place(std::move(e));
+      }
+      else if (_current < now)
+        step();
+      else
+        return false;
+    }
+    return busy(now);
+  }
+
+  /// True if advance() at `now` has work to do
+  bool busy(uint32_t now) const { return _size != 0 && (!_due.empty() || !_pending.empty() || _current < now); }
+
+  /// Scheduled entries, superseded ones included
+  size_t size() const { return _size; }
+  bool empty() const { return _size == 0; }
+
+private:
+  // Calls `fn` for `e` if it is its name's live hint, and forgets the name once no entry points at it
+  template <typename F>
+  void fire(const entry &e, F &&fn)
+  {
+    auto it = _hints.find(*e.name);
+    --it->second.entries;
+    if (it->second.deadline == e.deadline)
+    {
+      it->second.deadline = 0;
+      // `fn` may schedule the name again, which keeps it, and it may rehash _hints
+      fn(e.path(), e.key(), e.deadline);
+      it = _hints.find(*e.name);
+    }
+    if (it->second.entries == 0)
+      _hints.erase(it);
+  }
+
+  void place(entry e)
+  {
+    if (e.deadline <= _current)
+    {
+      _due.push_back(std::move(e));
+      return;
+    }
+
+    uint64_t delta = e.deadline - _current;
+    size_t level = 0;
+    while (level + 1 < LEVELS && delta >= (uint64_t{1} << (BITS * (level + 1)))) ++level;
+    _wheels[level][(e.deadline >> (BITS * level)) & (SLOTS - 1)].push_back(std::move(e));
+  }
+
+  // Moves the clock on one second. Buckets only change hands here, redistributing them is left to advance().
+  void step()
+  {
+    ++_current;
+    for (size_t level = 1; level < LEVELS; ++level)
+    {
+      if ((_current & ((uint64_t{1} << (BITS * level)) - 1)) != 0)
+        break;
+      auto &bucket = _wheels[level][(_current >> (BITS * level)) & (SLOTS - 1)];
+      if (!bucket.empty())
+        _pending.push_back(std::move(bucket));
+      bucket.clear();
+    }
+    _due.swap(_wheels[0][_current & (SLOTS - 1)]);
+  }
+};
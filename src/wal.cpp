@@ -0,0 +1,480 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <format>
+#include <print>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "wal.hpp"
+
+#include "assert.hpp"
+
+namespace
+{
+  constexpr size_t HEADER_SIZE = 4 + 4;
+  constexpr size_t BODY_HEADER_SIZE = 1 + 4 + 4 + 4 + 1;
+  constexpr uint32_t BODY_MAX = 1u << 30;
+
+  template <typename T>
+  void store_le(std::string &out, T v)
+  {
+    char b[sizeof(T)];
+    std::memcpy(b, &v, sizeof(T));
+    out.append(b, sizeof(T));
+  }
+
+  template <typename T>
+  T load_le(const char *p)
+  {
+    T v;
+    std::memcpy(&v, p, sizeof(T));
+    return v;
+  }
+
+  uint32_t checksum(const char *p, size_t n) { return static_cast<uint32_t>(Wyhash{}(std::string_view(p, n))); }
+
+  // Reads the records of `fd` in place. A file that is empty or cannot be mapped comes back empty.
+  struct Mapping
+  {
+    const char *data = nullptr;
+    size_t size = 0;
+
+    Mapping(int fd, size_t size) : size(size)
+    {
+      if (size == 0)
+        return;
+      void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p == MAP_FAILED)
+      {
+        this->size = 0;
+        return;
+      }
+      madvise(p, size, MADV_SEQUENTIAL);
+      data = static_cast<const char *>(p);
+    }
+    ~Mapping()
+    {
+      if (data)
+        munmap(const_cast<char *>(data), size);
+    }
+    Mapping(const Mapping &) = delete;
+    Mapping &operator=(const Mapping &) = delete;
+  };
+
+  // Parses the record at buf[pos] like parse_record(), checking its checksum only if `verify`
+  std::optional<Wal_record> read_record(std::string_view buf, size_t &pos, bool verify)
+  {
+    if (buf.size() - pos < HEADER_SIZE + BODY_HEADER_SIZE)
+      return std::nullopt;
+
+    const char *h = buf.data() + pos;
+    uint32_t body = load_le<uint32_t>(h);
+    if (body < BODY_HEADER_SIZE || body > BODY_MAX || buf.size() - pos - HEADER_SIZE < body)
+      return std::nullopt;
+
+    const char *b = h + HEADER_SIZE;
+    if (verify && checksum(b, body) != load_le<uint32_t>(h + 4))
+      return std::nullopt;
+
+    uint8_t op = static_cast<uint8_t>(b[0]);
+    uint32_t deadline = load_le<uint32_t>(b + 1);
+    size_t path_len = load_le<uint32_t>(b + 5);
+    size_t key_len = load_le<uint32_t>(b + 9);
+    uint8_t type = static_cast<uint8_t>(b[13]);
+    if (op < static_cast<uint8_t>(Wal_op::CREATE) || op > static_cast<uint8_t>(Wal_op::EXPIRE) ||
+        path_len + key_len > body - BODY_HEADER_SIZE)
+      return std::nullopt;
+
+    const char *p = b + BODY_HEADER_SIZE;
+    std::string_view value(p + path_len + key_len, body - BODY_HEADER_SIZE - path_len - key_len);
+    Wal_record r{static_cast<Wal_op>(op), {p, path_len}, {p + path_len, key_len}, value, deadline};
+    switch (static_cast<Leaf_value::Type>(type))
+    {
+      case Leaf_value::Type::BYTES: break;
+      case Leaf_value::Type::INT:
+        if (value.size() != sizeof(int64_t))
+          return std::nullopt;
+        r.value = Leaf_value(load_le<int64_t>(value.data()));
+        break;
+      case Leaf_value::Type::DOUBLE:
+        if (value.size() != sizeof(double))
+          return std::nullopt;
+        r.value = Leaf_value(load_le<double>(value.data()));
+        break;
+      default: return std::nullopt;
+    }
+
+    pos += HEADER_SIZE + body;
+    return r;
+  }
+
+  // Cuts the records at the start of `buf` into chunks and checks them, a chunk per thread. Returns the bytes of whole
+  // records, up to the first one cut short or failing its checksum, and the chunks those make up.
+  std::pair<size_t, std::vector<size_t>> check_records(std::string_view buf)
+  {
+    // Walking the lengths is cheap, the checksums are the work
+    std::vector<size_t> chunks;
+    size_t end = 0;
+    while (buf.size() - end >= HEADER_SIZE + BODY_HEADER_SIZE)
+    {
+      uint32_t body = load_le<uint32_t>(buf.data() + end);
+      if (body < BODY_HEADER_SIZE || body > BODY_MAX || buf.size() - end - HEADER_SIZE < body)
+        break;
+      if (chunks.empty() || end - chunks.back() >= Wal_records::CHUNK_SIZE)
+        chunks.push_back(end);
+      end += HEADER_SIZE + body;
+    }
+    auto chunk_end = [&](size_t c) { return c + 1 < chunks.size() ? chunks[c + 1] : end; };
+
+    std::vector<size_t> checked(chunks.size()); // Where the whole records of each chunk end
+    std::atomic<size_t> next{0};
+    auto check = [&] {
+      for (size_t c; (c = next.fetch_add(1, std::memory_order_relaxed)) < chunks.size();)
+      {
+        size_t pos = chunks[c];
+        while (pos < chunk_end(c) && read_record(buf, pos, true));
+        checked[c] = pos;
+      }
+    };
+    size_t workers = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), chunks.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < workers; ++i) threads.emplace_back(check);
+    check();
+    for (auto &t : threads) t.join();
+
+    for (size_t c = 0; c < chunks.size(); ++c)
+      if (checked[c] != chunk_end(c))
+      {
+        end = checked[c];
+        chunks.resize(checked[c] > chunks[c] ? c + 1 : c);
+        break;
+      }
+    return {end, std::move(chunks)};
+  }
+
+  std::expected<void, std::string> write_all(int fd, std::string_view data, const std::string &path)
+  {
+    while (!data.empty())
+    {
+      ssize_t n = ::write(fd, data.data(), data.size());
+      if (n == -1 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return std::unexpected(std::format("Couldn't write {}: {}", path, std::strerror(errno)));
+      data.remove_prefix(n);
+    }
+    return {};
+  }
+
+  // Joins `old`, left by a rotation whose snapshot never finished, and the log at `path` into one file at `path`
+  std::expected<void, std::string> merge_rotated(const std::string &old, const std::string &path)
+  {
+    std::string merged;
+    for (const std::string *p : {&old, &path})
+    {
+      int fd = ::open(p->c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd == -1)
+      {
+        if (errno == ENOENT)
+          continue;
+        return std::unexpected(std::format("Couldn't open log {}: {}", *p, std::strerror(errno)));
+      }
+      struct stat st{};
+      if (fstat(fd, &st) == -1)
+      {
+        ::close(fd);
+        return std::unexpected(std::format("Couldn't stat log {}: {}", *p, std::strerror(errno)));
+      }
+      Mapping m(fd, st.st_size);
+      ::close(fd);
+      if (m.size != static_cast<size_t>(st.st_size))
+        return std::unexpected(std::format("Couldn't map log {}: {}", *p, std::strerror(errno)));
+
+      std::string_view buf(m.data, m.size);
+      merged.append(buf.substr(0, check_records(buf).first));
+    }
+
+    std::string tmp = path + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1)
+      return std::unexpected(std::format("Couldn't create {}: {}", tmp, std::strerror(errno)));
+    auto written = write_all(fd, merged, tmp);
+    if (written && fsync(fd) == -1)
+      written = std::unexpected(std::format("Couldn't sync {}: {}", tmp, std::strerror(errno)));
+    ::close(fd);
+    if (!written)
+      return written;
+
+    if (::rename(tmp.c_str(), path.c_str()) == -1)
+      return std::unexpected(std::format("Couldn't replace log {}: {}", path, std::strerror(errno)));
+    ::unlink(old.c_str());
+    std::println("Log {}: merged back the log rotated by an unfinished snapshot", path);
+    return {};
+  }
+}
+
+void append_record(std::string &out, const Wal_record &r)
+{
+  char buf[Leaf_value::TEXT_MAX];
+  std::string_view value;
+  switch (r.value.type())
+  {
+    case Leaf_value::Type::INT:
+    {
+      int64_t i = r.value.as_int();
+      std::memcpy(buf, &i, sizeof(i));
+      value = {buf, sizeof(i)};
+      break;
+    }
+    case Leaf_value::Type::DOUBLE:
+    {
+      double d = r.value.as_double();
+      std::memcpy(buf, &d, sizeof(d));
+      value = {buf, sizeof(d)};
+      break;
+    }
+    default: value = r.value.bytes(); break;
+  }
+
+  size_t body = BODY_HEADER_SIZE + r.path.size() + r.key.size() + value.size();
+  size_t start = out.size();
+  out.reserve(start + HEADER_SIZE + body);
+  store_le(out, static_cast<uint32_t>(body));
+  store_le(out, uint32_t{0}); // Checksum, filled in once the body is there
+
+  out.push_back(static_cast<char>(r.op));
+  store_le(out, r.deadline);
+  store_le(out, static_cast<uint32_t>(r.path.size()));
+  store_le(out, static_cast<uint32_t>(r.key.size()));
+  out.push_back(static_cast<char>(r.value.type()));
+  out.append(r.path).append(r.key).append(value);
+
+  uint32_t sum = checksum(out.data() + start + HEADER_SIZE, body);
+  std::memcpy(out.data() + start + 4, &sum, sizeof(sum));
+}
+
+std::optional<Wal_record> parse_record(std::string_view buf, size_t &pos) { return read_record(buf, pos, true); }
+
+std::expected<std::unique_ptr<Wal>, std::string> Wal::open(const std::string &path, Fsync_policy policy,
+                                                          unsigned interval_ms)
+{
+  std::string old = path + ".old";
+  if (::access(old.c_str(), F_OK) == 0)
+    if (auto merged = merge_rotated(old, path); !merged)
+      return std::unexpected(merged.error());
+
+  int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (fd == -1)
+    return std::unexpected(std::format("Couldn't open log {}: {}", path, std::strerror(errno)));
+
+  struct stat st{};
+  if (fstat(fd, &st) == -1)
+  {
+    ::close(fd);
+    return std::unexpected(std::format("Couldn't stat log {}: {}", path, std::strerror(errno)));
+  }
+
+  std::unique_ptr<Wal> wal(new Wal(path, fd, policy, interval_ms));
+  {
+    Mapping m(fd, st.st_size);
+    if (m.size != static_cast<size_t>(st.st_size))
+      return std::unexpected(std::format("Couldn't map log {}: {}", path, std::strerror(errno)));
+
+    std::tie(wal->_valid, wal->_chunks) = check_records(std::string_view(m.data, m.size));
+  }
+
+  if (wal->_valid != static_cast<size_t>(st.st_size))
+  {
+    std::println("Log {}: dropping {} bytes after the last whole record", path, st.st_size - wal->_valid);
+    if (ftruncate(fd, wal->_valid) == -1)
+      return std::unexpected(std::format("Couldn't truncate log {}: {}", path, std::strerror(errno)));
+  }
+
+  if (policy != Fsync_policy::NEVER)
+    wal->_syncer = std::thread([w = wal.get()] { w->sync_loop(); });
+  return wal;
+}
+
+Wal::~Wal()
+{
+  if (_syncer.joinable())
+  {
+    {
+      std::lock_guard lock(_mutex);
+      _stop = true;
+    }
+    _wake.notify_one();
+    _syncer.join();
+  }
+  if (_fd != -1)
+    ::close(_fd);
+  if (_old_fd != -1)
+    ::close(_old_fd);
+}
+
+std::size_t Wal::replay(const std::function<void(const Wal_record &)> &fn) const
+{
+  auto all = records();
+  std::size_t read = 0;
+  for (std::size_t c = 0; c < all->chunk_count(); ++c)
+    all->read_chunk(c, [&](uint32_t, const Wal_record &r) {
+      fn(r);
+      ++read;
+    });
+  return read;
+}
+
+std::shared_ptr<const Wal_records> Wal::records() const
+{
+  std::shared_ptr<Wal_records> records(new Wal_records());
+  if (_valid == 0)
+    return records;
+  void *p = mmap(nullptr, _valid, PROT_READ, MAP_PRIVATE, _fd, 0);
+  if (p == MAP_FAILED)
+    return records;
+  // Read by every reactor at once, in different places, let the kernel bring in the whole file
+  madvise(p, _valid, MADV_WILLNEED);
+  records->_data = static_cast<const char *>(p);
+  records->_size = _valid;
+  records->_chunks = _chunks;
+  return records;
+}
+
+Wal_records::~Wal_records()
+{
+  if (_data)
+    munmap(const_cast<char *>(_data), _size);
+}
+
+void Wal_records::read_chunk(std::size_t c, const std::function<void(uint32_t, const Wal_record &)> &fn) const
+{
+  std::string_view buf(_data, c + 1 < _chunks.size() ? _chunks[c + 1] : _size);
+  std::size_t start = _chunks[c];
+  for (std::size_t pos = start, at = start; auto r = read_record(buf, pos, false); at = pos)
+    fn(static_cast<uint32_t>(at - start), *r);
+}
+
+Wal_record Wal_records::at(std::size_t c, uint32_t offset) const
+{
+  std::size_t pos = _chunks[c] + offset;
+  return *read_record(std::string_view(_data, _size), pos, false);
+}
+
+uint64_t Wal::write(std::string_view batch)
+{
+  int fd = _fd.load(std::memory_order_acquire);
+  while (!batch.empty())
+  {
+    ssize_t n = ::write(fd, batch.data(), batch.size());
+    if (n == -1 && errno == EINTR)
+      continue;
+    // Acknowledged writes that never reach the log would be lost silently on restart, stop instead
+    __assert(n > 0, std::format("Writing the log failed: {}", std::strerror(errno)));
+    batch.remove_prefix(n);
+  }
+
+  uint64_t batch_no = _written.fetch_add(1, std::memory_order_acq_rel) + 1;
+  if (_policy == Fsync_policy::ALWAYS)
+  {
+    // Taking the lock orders this against the syncer checking for work, so the wakeup cannot slip in between
+    { std::lock_guard lock(_mutex); }
+    _wake.notify_one();
+  }
+  return batch_no;
+}
+
+std::expected<void, std::string> Wal::rotate()
+{
+  std::lock_guard lock(_mutex);
+  if (_old_fd != -1)
+    return {};
+
+  std::string old = _path + ".old";
+  if (::rename(_path.c_str(), old.c_str()) == -1)
+    return std::unexpected(std::format("Couldn't rotate log {}: {}", _path, std::strerror(errno)));
+  int fd = ::open(_path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (fd == -1)
+  {
+    int err = errno;
+    ::rename(old.c_str(), _path.c_str());
+    return std::unexpected(std::format("Couldn't open log {}: {}", _path, std::strerror(err)));
+  }
+
+  // Writers that loaded the old descriptor finish into the old file, the syncer keeps syncing it until it is dropped
+  _old_fd = _fd.exchange(fd, std::memory_order_acq_rel);
+  _retired = false;
+  return {};
+}
+
+void Wal::drop_rotated()
+{
+  std::lock_guard lock(_mutex);
+  if (_old_fd == -1)
+    return;
+  ::unlink((_path + ".old").c_str());
+
+  // The syncer may be in the middle of syncing it, so it closes it itself
+  if (_syncer.joinable())
+    _retired = true;
+  else
+    ::close(std::exchange(_old_fd, -1));
+  _wake.notify_one();
+}
+
+void Wal::listen(int eventfd)
+{
+  std::lock_guard lock(_mutex);
+  _listeners.push_back(eventfd);
+}
+
+void Wal::sync_loop()
+{
+  std::unique_lock lock(_mutex);
+  for (;;)
+  {
+    if (_policy == Fsync_policy::ALWAYS)
+      _wake.wait(lock, [&] { return _stop || _retired || _written.load() != _synced.load(); });
+    else
+      _wake.wait_for(lock, std::chrono::milliseconds(_interval_ms), [&] { return _stop; });
+
+    // Batches counted here were written before, so one fdatasync covers all of them, and whatever more arrived
+    if (_retired)
+    {
+      ::close(std::exchange(_old_fd, -1));
+      _retired = false;
+    }
+
+    uint64_t written = _written.load(std::memory_order_acquire);
+    if (written != _synced.load())
+    {
+      // Batches counted may be in the rotated file too. Only this thread closes it, so it stays open while unlocked.
+      int fd = _fd.load(std::memory_order_acquire), old_fd = _old_fd;
+      lock.unlock();
+      __assert(fdatasync(fd) == 0, std::format("Syncing the log failed: {}", std::strerror(errno)));
+      if (old_fd != -1)
+        __assert(fdatasync(old_fd) == 0, std::format("Syncing the log failed: {}", std::strerror(errno)));
+      _synced.store(written, std::memory_order_release);
+      lock.lock();
+
+      if (_policy == Fsync_policy::ALWAYS)
+        for (int fd : _listeners)
+        {
+          uint64_t one = 1;
+          [[maybe_unused]] ssize_t n = ::write(fd, &one, sizeof(one));
+        }
+    }
+    if (_stop)
+      break;
+  }
+}
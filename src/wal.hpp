@@ -0,0 +1,177 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <expected>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "leaf_map.hpp"
+
+/*
+ * Write-ahead log. Every write a shard applies is appended as one record:
+ *
+ *      record : [u32 body_len][u32 checksum][body]
+ *      body   : [u8 op][u32 deadline][u32 path_len][u32 key_len][u8 value_type][path][key][value]
+ *
+ * The checksum is the low half of the wyhash of the body. Integers are little endian, numbers are stored in binary
+ * with their type so a replayed counter is the same counter. Deadlines are absolute Unix seconds, a record replayed
+ * after its deadline expires just as the original entry would have. Increments are logged as the PUT of their result.
+ *
+ * Replaying a record that the state already has is harmless, every op sets rather than adds. A snapshot rotates the
+ * log to `<path>.old` when it begins and deletes that once it is on disk; records written around the rotation may land
+ * in either file, and open() joins the two again if it finds both.
+ */
+
+enum class Wal_op : uint8_t { CREATE = 1, PUT, DEL, RMTREE, EXPIRE };
+
+// Views into the buffer the record was parsed from
+struct Wal_record
+{
+  Wal_op op;
+  std::string_view path;
+  std::string_view key = {};
+  Leaf_value value = std::string_view{};
+  uint32_t deadline = 0; // PUT and EXPIRE, 0 = never
+};
+
+// Appends the encoded record to `out`.
+void append_record(std::string &out, const Wal_record &r);
+
+// Parses the record starting at buf[pos] and advances `pos` past it. Returns std::nullopt and leaves `pos` alone if the
+// record is cut short or fails its checksum.
+std::optional<Wal_record> parse_record(std::string_view buf, size_t &pos);
+
+/**
+ * @brief The records a log held when it was opened, mapped in place and cut into chunks of whole records, so several
+ * threads can read it at once. Records were checked when the log was opened and are not checked again.
+ */
+class Wal_records
+{
+  const char *_data = nullptr;
+  std::size_t _size = 0;
+  std::vector<std::size_t> _chunks; ///< Offset of the first record of every chunk
+
+  friend class Wal;
+
+  Wal_records() = default;
+
+public:
+  /// A chunk ends with the first record starting this far past its own start
+  static constexpr std::size_t CHUNK_SIZE = 1 << 20;
+
+  ~Wal_records();
+
+  Wal_records(const Wal_records &) = delete;
+  Wal_records &operator=(const Wal_records &) = delete;
+
+  std::size_t chunk_count() const { return _chunks.size(); }
+
+  /// Calls `fn(offset, record)` for every record of chunk `c` in order, `offset` counted from the start of the chunk
+  void read_chunk(std::size_t c, const std::function<void(uint32_t, const Wal_record &)> &fn) const;
+
+  /// The record at `offset` in chunk `c`, as passed to read_chunk()
+  Wal_record at(std::size_t c, uint32_t offset) const;
+};
+
+enum class Fsync_policy : uint8_t
+{
+  ALWAYS,   ///< Every batch, replies to writes wait for it
+  INTERVAL, ///< Every few milliseconds
+  NEVER,    ///< Left to the kernel
+};
+
+/**
+ * @brief Append-only log file shared by every reactor.
+ *
+ * Reactors collect their records for a whole event loop iteration and hand them over with write(), one write(2) per
+ * batch. The file is opened with O_APPEND, so batches of different reactors never interleave. fsync never runs on a
+ * reactor: a background thread syncs after every batch or on a timer, and reports progress through synced(). With
+ * Fsync_policy::ALWAYS it also signals every eventfd passed to listen() after each sync.
+ */
+class Wal
+{
+  std::string _path;
+  std::atomic<int> _fd{-1};
+  int _old_fd = -1;                    ///< Log rotated away by rotate(), kept until drop_rotated()
+  bool _retired = false;               ///< drop_rotated() ran, the syncer closes _old_fd
+  Fsync_policy _policy;
+  unsigned _interval_ms;
+  std::size_t _valid = 0;              ///< Bytes of whole records found by open(), what replay() reads
+  std::vector<std::size_t> _chunks;    ///< Chunks of those, see Wal_records
+  std::atomic<uint64_t> _written{0};   ///< Batches written so far, also the number of the last one
+  std::atomic<uint64_t> _synced{0};    ///< Batches known to be on disk
+
+  std::mutex _mutex;
+  std::condition_variable _wake;
+  bool _stop = false;
+  std::vector<int> _listeners;
+  std::thread _syncer;
+
+  Wal(std::string path, int fd, Fsync_policy policy, unsigned interval_ms)
+    : _path(std::move(path)), _fd(fd), _policy(policy), _interval_ms(interval_ms)
+  {}
+
+public:
+  /**
+   * @brief Opens or creates the log at `path`. A torn record at the end, left by a crash in the middle of a write, is
+   * cut off so new batches follow the last whole one. A `<path>.old` left by a snapshot that never finished is put
+   * back in front. Records are checked a chunk per thread, on as many threads as there are cores.
+   *
+   * @param interval_ms Milliseconds between syncs with Fsync_policy::INTERVAL
+   */
+  static std::expected<std::unique_ptr<Wal>, std::string> open(const std::string &path, Fsync_policy policy,
+                                                               unsigned interval_ms = 1000);
+
+  /// Syncs what is left and closes the file
+  ~Wal();
+
+  Wal(const Wal &) = delete;
+  Wal &operator=(const Wal &) = delete;
+
+  /**
+   * @brief Calls `fn` for every record the file held when it was opened, in order. Safe to run from several threads
+   * at once, each reactor replays its own shard.
+   *
+   * @return Records read
+   */
+  std::size_t replay(const std::function<void(const Wal_record &)> &fn) const;
+
+  /// Maps the records the file held when it was opened, for threads to share out. Empty if it cannot be mapped.
+  std::shared_ptr<const Wal_records> records() const;
+
+  /**
+   * @brief Appends one batch of records.
+   *
+   * @return Number of the batch, on disk once synced() reaches it
+   */
+  uint64_t write(std::string_view batch);
+
+  uint64_t synced() const { return _synced.load(std::memory_order_acquire); }
+
+  /// Signal `eventfd` after every sync, only done with Fsync_policy::ALWAYS
+  void listen(int eventfd);
+
+  Fsync_policy policy() const { return _policy; }
+
+  /**
+   * @brief Moves the log aside to `<path>.old` and carries on in a new, empty file. Batches already written stay in
+   * the old one. Nothing to do if the old one is still there from an earlier rotation.
+   */
+  std::expected<void, std::string> rotate();
+
+  /// Deletes the log moved aside by rotate(), once a snapshot holds everything in it
+  void drop_rotated();
+
+private:
+  void sync_loop();
+};
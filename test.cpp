@@ -1,10 +1,17 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
 #include <iostream>
+#include <memory>
+#include <random>
 #include <string>
 #include <unordered_map>
 #include <vector>
 #include <cassert>
 
+#include "./src/child_index.hpp"
 #include "./src/leaf_map.hpp"
+#include "./src/timer_wheel.hpp"
 
 #define TEST(cond)                                                                \
   do {                                                                            \
@@ -19,12 +26,43 @@
     }                                                                             \
   } while (0)
 
+// Checks a hasher on `keys`: no full 64-bit collisions, and both the slot bits (low) and the fingerprint bits
+// (top 7) spread close to uniformly, judged by a chi-square test at six standard deviations.
+template <typename Hasher>
+int check_hash_quality(const std::vector<std::string> &keys)
+{
+  constexpr size_t SLOTS = 1 << 16;
+  Hasher hash;
+  std::vector<uint64_t> hashes;
+  std::vector<double> slots(SLOTS), fingerprints(128);
+  for (const auto &k : keys)
+  {
+    uint64_t h = hash(k);
+    hashes.push_back(h);
+    ++slots[h & (SLOTS - 1)];
+    ++fingerprints[h >> 57];
+  }
+
+  std::sort(hashes.begin(), hashes.end());
+  TEST(std::adjacent_find(hashes.begin(), hashes.end()) == hashes.end());
+
+  auto chi_square_ok = [&](const std::vector<double> &counts) {
+    double expected = double(keys.size()) / counts.size(), chi = 0;
+    for (double c : counts) chi += (c - expected) * (c - expected) / expected;
+    double dof = counts.size() - 1;
+    return chi < dof + 6 * std::sqrt(2 * dof);
+  };
+  TEST(chi_square_ok(slots));
+  TEST(chi_square_ok(fingerprints));
+  return 0;
+}
+
 int main()
 {
   std::string s;
   // Test 1: Basic functionality
   {
-    leaf_map map;
+    Leaf_map map;
     TEST(map.size() == 0);
     TEST(map.empty());
 
@@ -40,7 +78,7 @@ int main()
     TEST(*map.get("apple") == "fruit");
     TEST(*map.get("banana") == "yellow");
     TEST(*map.get("carrot") == "vegetable");
-    TEST(map.get("nonexistent") == nullptr);
+    TEST(!map.get("nonexistent"));
 
     // Test contains
     TEST(map.contains("apple"));
@@ -60,13 +98,13 @@ int main()
     TEST(*map.get("") == "kk");
     map.put("kk", "");
     TEST(*map.get("kk") == "");
-    s = *map.get_opt("apple");
+    s = map.get("apple")->to_string();
   }
   TEST(s == "red");
 
   // Test 2: Erase functionality
   {
-    leaf_map map;
+    Leaf_map map;
     map.put("one", "1");
     map.put("two", "2");
     map.put("three", "3");
@@ -75,7 +113,7 @@ int main()
     TEST(!map.erase("two"));   // Already deleted
     TEST(!map.erase("four"));  // Never existed
     TEST(map.size() == 2);
-    TEST(map.get("two") == nullptr);
+    TEST(!map.get("two"));
 
     // Should still be able to insert after delete
     map.put("two", "II");
@@ -85,7 +123,7 @@ int main()
 
   // Test 3: Iterator functionality
   {
-    leaf_map map;
+    Leaf_map map;
     std::unordered_map<std::string, std::string> ref_map;
 
     // Insert some random data
@@ -105,7 +143,7 @@ int main()
 
     // Test iterator visits all elements
     std::unordered_map<std::string, std::string> visited;
-    for (const auto &p : map) visited[p.first] = p.second;
+    for (const auto &p : map) visited[std::string(p.first)] = p.second.to_string();
     TEST(visited == ref_map);
 
     // Test iterator after erase
@@ -115,13 +153,13 @@ int main()
     ref_map.erase("g");
 
     visited.clear();
-    for (const auto &p : map) visited[p.first] = p.second;
+    for (const auto &p : map) visited[std::string(p.first)] = p.second.to_string();
     TEST(visited == ref_map);
   }
 
   // Test 4: Rehashing and capacity
   {
-    leaf_map map(4);  // Small initial size to force rehashing
+    Leaf_map map(4);  // Small initial size to force rehashing
     TEST(map.size() == 0);
 
     // Insert enough elements to trigger multiple rehashes
@@ -155,7 +193,7 @@ int main()
 
   // Test 5: Edge cases
   {
-    leaf_map map;
+    Leaf_map map;
 
     // Empty string keys and values
     map.put("", "empty key");
@@ -179,10 +217,10 @@ int main()
 
   // Test 7: Const correctness
   {
-    leaf_map map;
+    Leaf_map map;
     map.put("const", "test");
 
-    const leaf_map &const_map = map;
+    const Leaf_map &const_map = map;
     TEST(*const_map.get("const") == "test");
     TEST(const_map.get_or("const", "default") == "test");
     TEST(const_map.get_or("missing", "default") == "default");
@@ -199,6 +237,396 @@ int main()
     }
   }
 
+  // Test 8: Hash distribution on realistic keys
+  {
+    std::vector<std::string> keys;
+    for (int i = 0; i < 300000; ++i)
+    {
+      keys.push_back("users/login/sessions/" + std::to_string(10000000 + i));
+      keys.push_back("user:" + std::to_string(i) + ":email");
+      keys.push_back("session-token-" + std::to_string(i * 2654435761u) + "-" + std::string(40, 'k'));
+    }
+    // Short keys differing in one byte
+    for (int i = 0; i < 65536; ++i) keys.push_back({char(i & 0xff), char(i >> 8)});
+
+    TEST(check_hash_quality<Wyhash>(keys) == 0);
+    TEST(check_hash_quality<Xxhash64>(keys) == 0);
+  }
+
+  // Test 9: Alternative hasher
+  {
+    Basic_leaf_map<Xxhash64> map(4);
+    for (int i = 0; i < 1000; ++i) map.put("key" + std::to_string(i), std::to_string(i));
+    TEST(map.size() == 1000);
+    TEST(*map.get("key500") == "500");
+    TEST(map.erase("key500"));
+    TEST(!map.contains("key500"));
+  }
+
+  // Test 10: Incremental resize, mixed operations while both tables are live
+  {
+    Leaf_map map;
+    std::unordered_map<std::string, std::string> ref_map;
+    std::mt19937 rng(3);
+    bool saw_resize = false, consistent = true, iter_ok = true;
+
+    for (int i = 0; i < 200000; ++i)
+    {
+      std::string key = "k" + std::to_string(rng() % 50000);
+      switch (rng() % 4)
+      {
+        case 0:
+        case 1:
+          map.put(key, std::to_string(i));
+          ref_map[key] = std::to_string(i);
+          break;
+        case 2:
+          consistent &= map.erase(key) == (ref_map.erase(key) == 1);
+          break;
+        case 3:
+        {
+          auto it = ref_map.find(key);
+          auto v = map.get(key);
+          consistent &= it == ref_map.end() ? !v : v && *v == it->second;
+          break;
+        }
+      }
+      consistent &= map.size() == ref_map.size();
+
+      if (map.resizing() && !saw_resize)
+      {
+        saw_resize = true;
+        std::unordered_map<std::string, std::string> visited;
+        for (const auto &p : map) visited[std::string(p.first)] = p.second.to_string();
+        iter_ok = visited == ref_map;
+      }
+    }
+
+    TEST(saw_resize);
+    TEST(consistent);
+    TEST(iter_ok);
+    for (const auto &[k, v] : ref_map) consistent &= map.get(k) == v;
+    TEST(consistent);
+  }
+
+  // Test 11: Inline and arena strings
+  {
+    Leaf_map map;
+    // Around the 12 byte inline limit, and long keys sharing their 4 byte inline prefix
+    for (size_t len : {11, 12, 13, 100})
+      for (char c : {'a', 'b'})
+        map.put("pref" + std::string(len - 4, c), std::string(len, c));
+    bool ok = true;
+    for (size_t len : {11, 12, 13, 100})
+      for (char c : {'a', 'b'})
+        ok &= map.get("pref" + std::string(len - 4, c)) == std::string(len, c);
+    TEST(ok);
+    TEST(!map.get("pref" + std::string(96, 'c')));
+
+    // Overwrite long values with shorter, longer and inline ones
+    map.put("pref" + std::string(96, 'a'), std::string(50, 'x'));
+    TEST(map.get("pref" + std::string(96, 'a')) == std::string(50, 'x'));
+    map.put("pref" + std::string(96, 'a'), std::string(500, 'y'));
+    TEST(map.get("pref" + std::string(96, 'a')) == std::string(500, 'y'));
+    map.put("pref" + std::string(96, 'a'), "short");
+    TEST(map.get("pref" + std::string(96, 'a')) == "short");
+
+    // Rewriting long values leaves dead arena bytes, the map must compact rather than grow without bound
+    size_t before = map.bytes();
+    for (int i = 0; i < 100000; ++i) map.put("session", std::string(100 + i % 2, char('a' + i % 26)));
+    TEST(map.get("session") == std::string(101, char('a' + 99999 % 26)));
+    TEST(map.bytes() < before + (1 << 20));
+    TEST(map.size() == 9);
+  }
+
+  // Test 12: Robin Hood probe lengths and stats
+  {
+    Leaf_map map;
+    for (int i = 0; i < 100000; ++i) map.put("user:" + std::to_string(i), "v");
+
+    Leaf_map_stats st = map.stats();
+    TEST(st.size == 100000);
+    TEST(st.load_factor > 0.3 && st.load_factor <= 0.875);
+    TEST(st.rehashes > 0);
+    TEST(st.avg_probe >= 1 && st.avg_probe < 4);
+    TEST(st.max_probe < 64);
+
+    for (int i = 0; i < 100000; i += 2) map.erase("user:" + std::to_string(i));
+    bool ok = true;
+    for (int i = 0; i < 100000; ++i) ok &= map.contains("user:" + std::to_string(i)) == (i % 2 == 1);
+    TEST(ok);
+    TEST(map.stats().size == 50000);
+
+    for (int i = 1; i < 100000; i += 2) map.erase("user:" + std::to_string(i));
+    TEST(map.stats().max_probe == 0);
+    TEST(map.stats().avg_probe == 0);
+  }
+
+  // Test 13: Typed values and increments
+  {
+    Leaf_map map;
+    map.put("n", "42");
+    map.put("d", "2.5");
+    map.put("padded", "042");
+    map.put("text", "abc");
+    TEST(map.get("n")->type() == Leaf_value::Type::INT);
+    TEST(map.get("d")->type() == Leaf_value::Type::DOUBLE);
+    TEST(map.get("padded")->type() == Leaf_value::Type::BYTES);
+    TEST(*map.get("n") == "42");
+    TEST(*map.get("d") == "2.5");
+    TEST(*map.get("padded") == "042");
+
+    TEST(map.incr("n", Leaf_value(int64_t{8}))->as_int() == 50);
+    TEST(map.incr("n", Leaf_value(int64_t{-60}))->as_int() == -10);
+    TEST(map.incr("counter", Leaf_value(int64_t{1}))->as_int() == 1);
+    TEST(*map.incr("d", Leaf_value(int64_t{1})) == "3.5");
+    TEST(*map.incr("n", Leaf_value(0.5)) == "-9.5");
+    TEST(map.incr("padded", Leaf_value(int64_t{1}))->as_int() == 43);
+    TEST(!map.incr("text", Leaf_value(int64_t{1})));
+    TEST(*map.get("text") == "abc");
+
+    map.put("max", std::to_string(INT64_MAX));
+    TEST(!map.incr("max", Leaf_value(int64_t{1})));
+    TEST(map.get("max")->as_int() == INT64_MAX);
+
+    TEST(map.put("n", Leaf_value(int64_t{7})) == "7");
+    map.put("n", "seven");
+    TEST(*map.get("n") == "seven");
+
+    TEST(Leaf_value::parse_number("1e3")->as_double() == 1000);
+    TEST(!Leaf_value::parse_number("12abc"));
+    TEST(!Leaf_value::parse_number(""));
+
+    // Numbers keep their type while the map moves slots between tables
+    for (int i = 0; i < 10000; ++i) map.incr("c" + std::to_string(i % 100), Leaf_value(int64_t{i}));
+    bool ok = true;
+    for (int i = 0; i < 100; ++i)
+    {
+      auto v = map.get("c" + std::to_string(i));
+      ok &= v && v->type() == Leaf_value::Type::INT && v->as_int() == 100 * i + 495000;
+    }
+    TEST(ok);
+  }
+
+  // Test 14: Expiry
+  {
+    coarse_clock::NOW_MS = 1'000'000'000'000;
+    uint32_t now = coarse_clock::seconds();
+
+    Leaf_map map;
+    map.put("session", "abc", now + 10);
+    map.put("counter", "5", now + 10);
+    map.put("forever", "x");
+    TEST(map.contains("session"));
+    TEST(coarse_clock::deadline(10) == now + 10);
+
+    coarse_clock::NOW_MS += 9'999;
+    TEST(*map.get("session") == "abc");
+    TEST(map.incr("counter", Leaf_value(int64_t{1}))->as_int() == 6);
+    TEST(!map.erase_expired("session"));
+
+    coarse_clock::NOW_MS += 1;
+    const Leaf_map &const_map = map;
+    TEST(!const_map.get("session"));
+    TEST(map.size() == 3);
+    size_t count = 0;
+    for (auto it = map.begin(); it != map.end(); ++it) ++count;
+    TEST(count == 1);
+
+    // Lazy removal on access
+    TEST(!map.get("session"));
+    TEST(map.size() == 2);
+    TEST(map.erase_expired("counter"));
+    TEST(!map.erase_expired("forever"));
+    TEST(map.size() == 1);
+
+    // Rewriting a key replaces its deadline, incr of an expired key starts over
+    map.put("k", "1", now + 20);
+    map.put("k", "2");
+    map.put("c", "100", now + 20);
+    coarse_clock::NOW_MS += 20'000;
+    TEST(*map.get("k") == "2");
+    TEST(map.incr("c", Leaf_value(int64_t{1}))->as_int() == 1);
+    coarse_clock::NOW_MS += 1'000'000;
+    TEST(map.get("c")->as_int() == 1);
+
+    // Deadlines survive resizes, and expired entries are dropped by them
+    Leaf_map big;
+    now = coarse_clock::seconds();
+    for (int i = 0; i < 100000; ++i) big.put("k" + std::to_string(i), "v", i % 2 ? now + 5 : 0);
+    coarse_clock::NOW_MS += 5'000;
+    for (int i = 100000; i < 300000; ++i) big.put("k" + std::to_string(i), "v");
+    bool ok = true;
+    for (int i = 0; i < 100000; ++i) ok &= big.contains("k" + std::to_string(i)) == (i % 2 == 0);
+    TEST(ok);
+    TEST(big.size() < 300000);
+    coarse_clock::NOW_MS = 0;
+  }
+
+  // Test 15: Timer wheel
+  {
+    Timer_wheel wheel;
+    uint32_t start = 1'700'000'000;
+    std::mt19937 rng(9);
+    std::vector<uint32_t> offsets;
+    for (int i = 0; i < 20000; ++i)
+      offsets.push_back(i < 10000 ? rng() % 100 : i < 15000 ? rng() % 10000 : rng() % 1'000'000);
+    offsets.push_back(0);
+    offsets.push_back(1);
+    offsets.push_back(64);
+    offsets.push_back(4096);
+    for (size_t i = 0; i < offsets.size(); ++i)
+      wheel.schedule(start + offsets[i], start, "path/", std::to_string(i));
+
+    bool on_time = true;
+    size_t fired = 0;
+    uint32_t now = start;
+    for (; now <= start + 1'000'000 && !wheel.empty(); now += 7)
+    {
+      // A small budget spreads each step over several calls
+      while (wheel.advance(now, 64, [&](std::string_view path, std::string_view key, uint32_t deadline) {
+        ++fired;
+        on_time &= path == "path/" && deadline <= now && deadline + 7 > now &&
+                   deadline == start + offsets[std::stoul(std::string(key))];
+      }));
+    }
+    TEST(fired == offsets.size());
+    TEST(on_time);
+    TEST(wheel.empty());
+  }
+
+  // Test 16: CLOCK eviction
+  {
+    Leaf_map map;
+    for (int i = 0; i < 10000; ++i) map.put("k" + std::to_string(i), std::string(40, 'v'));
+    size_t full = map.bytes();
+
+    // New entries start referenced, the first sweep only clears their bits
+    auto [visited, erased] = map.evict(SIZE_MAX);
+    TEST(erased == 0);
+    TEST(visited < SIZE_MAX);
+
+    for (int i = 0; i < 100; ++i) map.get("k" + std::to_string(i));
+    map.put("k9999", "rewritten");
+    std::tie(visited, erased) = map.evict(SIZE_MAX);
+    TEST(erased == 10000 - 101);
+    TEST(map.size() == 101);
+    bool ok = true;
+    for (int i = 0; i < 100; ++i) ok &= map.contains("k" + std::to_string(i));
+    TEST(ok);
+    TEST(*map.get("k9999") == "rewritten");
+
+    // Bounded steps, and the map shrinks once they have drained it
+    size_t steps = 0;
+    while (map.size() > 0 && steps < 10000) map.evict(64), ++steps;
+    TEST(map.size() == 0);
+    TEST(map.bytes() < full / 50);
+  }
+
+  // Test 17: A shrunk table takes inserts without ever draining the old one in a single step
+  {
+    Leaf_map map;
+    for (int i = 0; i < 100000; ++i) map.put("k" + std::to_string(i), "v");
+    while (map.resizing()) map.put("k0", "v");
+    size_t full_cap = map.stats().capacity;
+
+    int erased = 0;
+    while (!map.resizing()) map.erase("k" + std::to_string(erased++));
+    TEST(map.stats().capacity < full_cap);
+
+    // A resize starting while the last one still drains means that one was finished off in one go
+    bool incremental = true;
+    for (int i = 0; i < 200000; ++i)
+    {
+      bool draining = map.resizing();
+      size_t rehashes = map.stats().rehashes;
+      map.put("n" + std::to_string(i), "v");
+      incremental &= !draining || map.stats().rehashes == rehashes;
+    }
+    TEST(incremental);
+    TEST(map.size() == size_t(100000 - erased + 200000));
+  }
+
+  // Test 18: Keys and values longer than a packed string holds are turned down, the map stays as it was
+  {
+    Leaf_map map;
+    map.put("k", "v");
+    // Never written, put() turns it down by its length alone
+    std::unique_ptr<char[]> huge(new char[Leaf_map::MAX_STRING + 1]);
+    std::string_view too_long(huge.get(), Leaf_map::MAX_STRING + 1);
+    TEST(!map.put("k", too_long));
+    TEST(!map.put(too_long, "v"));
+    TEST(!map.incr(too_long, Leaf_value(int64_t{1})));
+    TEST(map.size() == 1 && *map.get("k") == "v");
+  }
+
+  // Test 19: A key scheduled over and over keeps one timer wheel entry, an earlier deadline supersedes it
+  {
+    Timer_wheel wheel;
+    uint32_t start = 1'700'000'000;
+    for (uint32_t i = 0; i < 1000; ++i) wheel.schedule(start + 10 + i, start + i, "path/", "refreshed");
+    TEST(wheel.size() == 1);
+    wheel.schedule(start + 5, start, "path/", "refreshed");
+    wheel.schedule(start + 7, start, "path/", "other");
+    TEST(wheel.size() == 3);
+
+    // Fires at 5, the callback moves it on to the deadline of the last write, the hint at 10 is dropped
+    std::vector<std::pair<std::string, uint32_t>> fired;
+    for (uint32_t now = start; now <= start + 1100; ++now)
+      while (wheel.advance(now, 64, [&](std::string_view path, std::string_view key, uint32_t deadline) {
+        fired.emplace_back(std::string(path) + std::string(key), deadline);
+        if (deadline == start + 5)
+          wheel.schedule(start + 1009, now, path, key);
+      }));
+    TEST(fired.size() == 3);
+    TEST(fired[0] == std::make_pair(std::string("path/refreshed"), start + 5));
+    TEST(fired[1] == std::make_pair(std::string("path/other"), start + 7));
+    TEST(fired[2] == std::make_pair(std::string("path/refreshed"), start + 1009));
+    TEST(wheel.empty());
+  }
+
+  // Test 20: Compacting a nearly full table grows it, so the inserts that follow never wait on a full drain
+  {
+    Leaf_map map;
+    const std::string value(100, 'v');
+    size_t n = 0;
+    while (map.stats().capacity < 1024 || map.resizing() || map.size() < 1024 * 7 / 8 - 4)
+      map.put("k" + std::to_string(n++), value);
+    TEST(map.stats().capacity == 1024);
+
+    // Reinserted entries leave their old bytes dead in the arena until it is compacted
+    size_t rehashes = map.stats().rehashes;
+    for (size_t i = 0; !map.resizing() && i < 10 * n; ++i)
+    {
+      map.erase("k" + std::to_string(i % n));
+      map.put("k" + std::to_string(i % n), value);
+    }
+    TEST(map.stats().rehashes == rehashes + 1);
+    TEST(map.stats().capacity == 2048);
+
+    for (int i = 0; i < 100; ++i) map.put("new" + std::to_string(i), value);
+    TEST(map.stats().rehashes == rehashes + 1);
+    TEST(map.size() == n + 100 && *map.get("k0") == value);
+  }
+
+  // Test 21: A child index gives its table back as children go, and finds the ones left
+  {
+    Child_index<int> index;
+    std::vector<int> children(100000);
+    bool ok = true;
+    for (uint32_t id = 1; id <= children.size(); ++id) ok &= index.insert(id, &children[id - 1]);
+    size_t largest = index.bytes();
+
+    for (uint32_t id = 1; id <= children.size() - 100; ++id) ok &= index.erase(id) == &children[id - 1];
+    TEST(ok);
+    TEST(index.size() == 100 && index.bytes() * 64 < largest);
+    for (uint32_t id = children.size() - 99; id <= children.size(); ++id) ok &= index.find(id) == &children[id - 1];
+    TEST(ok && index.find(1) == nullptr);
+
+    for (uint32_t id = children.size() - 99; id <= children.size(); ++id) index.erase(id);
+    TEST(index.empty() && index.bytes() <= Child_index<int>::SMALL_MAX * (sizeof(uint32_t) + sizeof(int *)));
+  }
+
   std::cout << "All tests passed successfully!" << std::endl;
   return 0;
 }
@@ -0,0 +1,167 @@
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <string>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "./src/output_buffer.hpp"
+#include "./src/server.hpp"
+
+// Counts every heap allocation made while `counting` is set.
+static bool counting = false;
+static size_t allocations = 0;
+
+// Once operator delete is inlined, g++ sees free() called on a pointer from operator new and warns, not knowing that
+// this operator new is malloc
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+void *operator new(std::size_t n)
+{
+  if (counting)
+    ++allocations;
+  if (void *p = std::malloc(n ? n : 1))
+    return p;
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+
+#pragma GCC diagnostic pop
+
+#define TEST(cond)                                                                \
+  do {                                                                            \
+    if (!(cond))                                                                  \
+    {                                                                             \
+      std::cerr << "Test failed at line " << __LINE__ << ": " #cond << std::endl; \
+      return 1;                                                                   \
+    }                                                                             \
+    else                                                                          \
+    {                                                                             \
+      std::cout << "Test passed: " #cond << std::endl;                            \
+    }                                                                             \
+  } while (0)
+
+// Runs one text command the way client_read does: parse the line in place, execute, append the reply.
+static void run(const std::string &line, std::string &out)
+{
+  if (auto cmd = parse_command(line))
+    execute_query(*cmd, Protocol::TEXT, out);
+}
+
+int main()
+{
+  std::string out;
+  out.reserve(4096);
+
+  const std::string long_key = "session-token-" + std::string(64, 'k');
+  const std::string long_value = std::string(200, 'v');
+
+  run("create users/login/sessions", out);
+  run("put users/login/sessions john 3", out);
+  run("put users/login/sessions " + long_key + " " + long_value, out);
+  out.clear();
+
+  // Test 1: GET of an existing short key
+  {
+    const std::string line = "get users/login/sessions john";
+    counting = true;
+    allocations = 0;
+    run(line, out);
+    counting = false;
+    TEST(out == "3\r\n");
+    TEST(allocations == 0);
+    out.clear();
+  }
+
+  // Test 2: GET of an existing key and value too long for the small string buffer
+  {
+    const std::string line = "get /users//login/sessions/ " + long_key;
+    counting = true;
+    allocations = 0;
+    run(line, out);
+    counting = false;
+    TEST(out == long_value + "\r\n");
+    TEST(allocations == 0);
+    out.clear();
+  }
+
+  // Test 3: pipelined batch of GETs framed out of one read buffer
+  {
+    std::string buf;
+    for (int i = 0; i < 100; ++i) buf += "get users/login/sessions john\r\n";
+
+    counting = true;
+    allocations = 0;
+    size_t pos = 0;
+    while (auto line = next_line(buf, pos))
+      if (auto cmd = parse_command(*line))
+        execute_query(*cmd, Protocol::TEXT, out);
+    counting = false;
+    TEST(out.size() == 100 * 3);
+    TEST(allocations == 0);
+    out.clear();
+  }
+
+  // Test 4: DEL of an existing key
+  {
+    run("put users/login/sessions jane 4", out);
+    out.clear();
+    const std::string line = "del users/login/sessions jane";
+    counting = true;
+    allocations = 0;
+    run(line, out);
+    counting = false;
+    TEST(out == "100 OK\r\n");
+    TEST(allocations == 0);
+    out.clear();
+
+    run("get users/login/sessions jane", out);
+    TEST(out != "4\r\n");
+    out.clear();
+  }
+
+  // Test 5: replies a full socket did not take go out whole and in order once it drains, on recycled chunks
+  {
+    int fds[2];
+    TEST(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) == 0);
+
+    std::string sent, received;
+    sent.reserve(1 << 20);
+    for (int round = 0; round < 2; ++round)
+    {
+      Output_buffer unsent;
+      counting = true;
+      allocations = 0;
+      for (int i = 0; i < 20000; ++i)
+      {
+        std::string_view reply = i % 3 ? "100 OK\r\n" : "a somewhat longer reply\r\n";
+        unsent.append(reply);
+        sent.append(reply);
+      }
+      counting = false;
+      if (round == 1)
+        TEST(allocations == 0);
+
+      while (!unsent.flush(fds[0]))
+      {
+        TEST(errno == EAGAIN);
+        char buf[4096];
+        for (ssize_t n; (n = read(fds[1], buf, sizeof(buf))) > 0;) received.append(buf, n);
+      }
+      TEST(unsent.empty());
+      char buf[4096];
+      for (ssize_t n; (n = read(fds[1], buf, sizeof(buf))) > 0;) received.append(buf, n);
+    }
+    TEST(received == sent);
+    close(fds[0]);
+    close(fds[1]);
+  }
+
+  std::cout << "All tests passed successfully!" << std::endl;
+  return 0;
+}
@@ -0,0 +1,378 @@
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <format>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "./src/data_tree.hpp"
+#include "./src/image.hpp"
+#include "./src/server.hpp"
+#include "./src/snapshot.hpp"
+#include "./src/wal.hpp"
+
+#define TEST(cond)                                                                \
+  do {                                                                            \
+    if (!(cond))                                                                  \
+    {                                                                             \
+      std::cerr << "Test failed at line " << __LINE__ << ": " #cond << std::endl; \
+      return 1;                                                                   \
+    }                                                                             \
+    else                                                                          \
+    {                                                                             \
+      std::cout << "Test passed: " #cond << std::endl;                            \
+    }                                                                             \
+  } while (0)
+
+int main()
+{
+  std::string out;
+
+  // Test 1: log records survive a reopen, a torn record at the end is dropped and later batches follow the last whole one
+  {
+    char path[] = "/tmp/dash_wal_XXXXXX";
+    int fd = mkstemp(path);
+    TEST(fd != -1);
+
+    std::string batch;
+    append_record(batch, {Wal_op::CREATE, "users/login"});
+    append_record(batch, {Wal_op::PUT, "users/login", "visits", Leaf_value(int64_t{-7}), 123});
+    append_record(batch, {Wal_op::PUT, "users/login", "name", std::string_view("john doe")});
+    std::string torn;
+    append_record(torn, {Wal_op::DEL, "users/login", "name"});
+    batch.append(torn, 0, torn.size() - 1);
+    TEST(write(fd, batch.data(), batch.size()) == static_cast<ssize_t>(batch.size()));
+    close(fd);
+
+    std::vector<std::string> seen;
+    auto collect = [&](const Wal_record &r) {
+      seen.push_back(std::format("{} {} {} {} {}", int(r.op), r.path, r.key, r.value.to_string(), r.deadline));
+    };
+    {
+      auto wal = Wal::open(path, Fsync_policy::NEVER);
+      TEST(wal.has_value());
+      TEST((*wal)->replay(collect) == 3);
+      (*wal)->write(torn);
+    }
+    TEST(seen.size() == 3);
+    TEST(seen[1] == "2 users/login visits -7 123");
+    TEST(seen[2] == "2 users/login name john doe 0");
+
+    seen.clear();
+    auto wal = Wal::open(path, Fsync_policy::NEVER);
+    TEST(wal.has_value());
+    TEST((*wal)->replay(collect) == 4);
+    TEST(seen[3] == "3 users/login name  0");
+    unlink(path);
+  }
+
+  // Test 2: a snapshot shows the tree as it was when the save began, whatever changes while it is written
+  {
+    Tree tree;
+    tree.insert("a/b");
+    tree.insert("a/b/c");
+    tree.insert("big");
+    (void)tree.set("a/b", "n", Leaf_value(int64_t{42}), 77);
+    (void)tree.set("a/b/c", "k", std::string_view("old"));
+    for (int i = 0; i < 2000; ++i) (void)tree.set("big", std::format("key{}", i), std::string_view(std::string(40, 'v')));
+    (void)tree.expire("a/b/c", 99);
+
+    Snapshot_writer writer;
+    tree.begin_save(writer);
+    tree.save(16);
+    (void)tree.set("a/b/c", "k", std::string_view("new"));
+    tree.remove("a/b");
+    tree.insert("fresh");
+    (void)tree.set("big", "key0", std::string_view("changed"));
+    while (tree.save(64));
+    TEST(!tree.saving());
+
+    std::map<std::string, std::string> seen;
+    std::string file = writer.output(), current;
+    size_t blocks = 0;
+    for (size_t pos = 0; pos < file.size(); ++blocks)
+    {
+      auto body = next_block(file, pos);
+      TEST(body.has_value());
+      TEST(decode_block(
+          *body,
+          [&](std::span<const std::string_view> path, uint32_t deadline) {
+            current.clear();
+            for (auto c : path) current.append("/").append(c);
+            seen[current] = std::to_string(deadline);
+          },
+          [&](std::string_view key, const Leaf_value &value, uint32_t deadline) {
+            seen[current + " " + std::string(key)] = std::format("{} {}", value.to_string(), deadline);
+          }));
+    }
+    TEST(blocks > 1);
+    TEST(seen.count("/fresh") == 0);
+    TEST(seen["/a/b/c"] == "99");
+    TEST(seen["/a/b n"] == "42 77");
+    TEST(seen["/a/b/c k"] == "old 0");
+    TEST(seen["/big key0"] == std::string(40, 'v') + " 0");
+    TEST(seen.size() == 5 + 2 + 2000);
+
+    file[file.size() - 1] ^= 1;
+    size_t pos = 0;
+    while (next_block(file, pos));
+    TEST(pos < file.size());
+
+    // A subtree removed after the save wrote its root, whatever of it was not written yet still goes into the file
+    for (int steps = 1; steps < 120; ++steps)
+    {
+      Tree t;
+      t.insert("a/b");
+      t.insert("a/b/c");
+      for (int i = 0; i < 100; ++i) (void)t.set("a/b/c", std::format("k{}", i), std::string_view("v"));
+
+      Snapshot_writer w;
+      t.begin_save(w);
+      for (int i = 0; i < steps; ++i) t.save(1);
+      t.remove("a/b");
+      while (t.collect(SIZE_MAX));
+      while (t.save(64));
+
+      std::size_t entries = 0;
+      std::string blocks = w.output(), node;
+      for (size_t at = 0; at < blocks.size();)
+      {
+        auto body = next_block(blocks, at);
+        TEST(body.has_value());
+        TEST(decode_block(
+            *body,
+            [&](std::span<const std::string_view> path, uint32_t) {
+              node.clear();
+              for (auto c : path) node.append("/").append(c);
+            },
+            [&](std::string_view, const Leaf_value &, uint32_t) { entries += node == "/a/b/c"; }));
+      }
+      TEST(entries == 100);
+    }
+  }
+
+  // Test 3: an image is served in place, a node's entries are copied out on its first change
+  {
+    Tree tree;
+    tree.insert("a/b");
+    tree.insert("empty");
+    (void)tree.set("a/b", "n", Leaf_value(int64_t{-3}), 0);
+    (void)tree.set("a/b", "d", Leaf_value(2.5), 0);
+    for (int i = 0; i < 300; ++i) (void)tree.set("a", std::format("k{}", i), std::string_view(std::format("v{}", i)));
+    (void)tree.expire("a/b", 4000000000u);
+
+    Snapshot_writer writer;
+    tree.begin_save(writer);
+    while (tree.save(SIZE_MAX));
+    std::string blocks = std::string(SNAPSHOT_MAGIC) + writer.output();
+
+    char path[] = "/tmp/dash_image_XXXXXX";
+    close(mkstemp(path));
+    TEST(write_image(blocks, path).has_value());
+    auto image = Image::open(path);
+    TEST(image.has_value());
+    TEST((*image)->node_count() == 4);
+
+    Tree mounted;
+    auto deadlines = mounted.mount(*image, [](std::string_view top) { return top != "empty"; });
+    TEST(mounted.node_count() == 3);
+    TEST(deadlines.size() == 1 && deadlines[0].first == "/a/b" && deadlines[0].second == 4000000000u);
+    TEST(mounted.image_nodes() == 2);
+    TEST(mounted.get("a", "k299").value().to_string() == "v299");
+    TEST(mounted.get("a/b", "n").value().as_int() == -3);
+    TEST(!mounted.get("a", "k300").has_value());
+    TEST(mounted.bytes() < tree.bytes());
+    TEST(!mounted.reap("a/b", "n") && mounted.image_nodes() == 2);
+    TEST(!mounted.erase("a", "nope") && mounted.image_nodes() == 2);
+    auto image_stats = mounted.stats("a").value();
+    TEST(mounted.image_nodes() == 2);
+    TEST(image_stats.size == 300 && image_stats.capacity >= 300 && image_stats.max_probe >= 1);
+    TEST(image_stats.avg_probe >= 1 && image_stats.bytes == 0);
+
+    (void)mounted.set("a", "k0", std::string_view("changed"));
+    TEST(mounted.image_nodes() == 1);
+    TEST(mounted.get("a", "k0").value().to_string() == "changed");
+    TEST(mounted.get("a", "k1").value().to_string() == "v1");
+    TEST(mounted.stats("a").value().size == 300);
+    mounted.remove("a");
+    while (mounted.collect(SIZE_MAX));
+    TEST(mounted.image_nodes() == 0);
+
+    {
+      auto file = std::fopen(path, "r+b");
+      std::fseek(file, sizeof(Image_header) + 4, SEEK_SET);
+      std::fputc('x', file);
+      std::fclose(file);
+    }
+    TEST(!Image::open(path).has_value());
+    unlink(path);
+  }
+
+  // Test 4: a log of several chunks reads back whole from any chunk, a bad record in the middle cuts it there
+  {
+    char path[] = "/tmp/dash_wal_XXXXXX";
+    int fd = mkstemp(path);
+    TEST(fd != -1);
+
+    std::string batch;
+    std::size_t bad_at = 0;
+    for (int i = 0; i < 30000; ++i)
+    {
+      if (i == 20000)
+        bad_at = batch.size();
+      append_record(batch, {Wal_op::PUT, "users/login", std::format("k{:05}", i), std::string_view(std::string(64, 'v'))});
+    }
+    TEST(write(fd, batch.data(), batch.size()) == static_cast<ssize_t>(batch.size()));
+
+    {
+      auto wal = Wal::open(path, Fsync_policy::NEVER);
+      TEST(wal.has_value());
+      auto records = (*wal)->records();
+      TEST(records->chunk_count() == batch.size() / Wal_records::CHUNK_SIZE + 1);
+
+      int next = 0, in_order = 0, found = 0;
+      for (std::size_t c = 0; c < records->chunk_count(); ++c)
+        records->read_chunk(c, [&](uint32_t offset, const Wal_record &r) {
+          in_order += r.key == std::format("k{:05}", next++);
+          found += records->at(c, offset).key == r.key;
+        });
+      TEST(next == 30000 && in_order == 30000 && found == 30000);
+    }
+
+    TEST(pwrite(fd, "x", 1, bad_at + 20) == 1);
+    close(fd);
+    auto wal = Wal::open(path, Fsync_policy::NEVER);
+    TEST(wal.has_value());
+    TEST((*wal)->replay([](const Wal_record &) {}) == 20000);
+    struct stat st{};
+    TEST(stat(path, &st) == 0 && static_cast<std::size_t>(st.st_size) == bad_at);
+    unlink(path);
+  }
+
+  // Test 5: a frame announcing more than MAX_REQUEST_SIZE is turned down from its header alone
+  {
+    auto frame = [](uint8_t op, uint16_t path_len, uint16_t key_len, uint32_t value_len) {
+      std::string f(binary::HEADER_SIZE, '\0');
+      f[0] = static_cast<char>(op);
+      std::memcpy(f.data() + 1, &path_len, 2);
+      std::memcpy(f.data() + 3, &key_len, 2);
+      std::memcpy(f.data() + 5, &value_len, 4);
+      return f;
+    };
+
+    std::string buf = frame(binary::OP_PUT, 1, 1, 1u << 29) + "ab";
+    size_t pos = 0;
+    auto cmd = parse_frame(buf, pos);
+    TEST(cmd && cmd->_type == Query_type::TOO_LARGE && pos == 0);
+
+    buf = frame(binary::OP_PUT, 1, 1, MAX_REQUEST_SIZE - binary::HEADER_SIZE - 2);
+    TEST(!parse_frame(buf, pos) && pos == 0);
+
+    execute_query(*cmd, Protocol::BINARY, out);
+    TEST(out.size() > binary::REPLY_HEADER_SIZE && out[0] == binary::STATUS_ERROR);
+    out.clear();
+  }
+
+  // Test 6: a client streaming more than MAX_REQUEST_SIZE with no newline is cut off once the limit is in, the server
+  // does not read the rest
+  {
+    std::string line(MAX_REQUEST_SIZE + 2, 'a');
+    TEST(request_too_large(line, Protocol::TEXT));
+    line.back() = '\n';
+    TEST(!request_too_large(line, Protocol::TEXT));
+    line.clear();
+    line.shrink_to_fit();
+
+    int listen_fd = init_server(0, HOST);
+    sockaddr_in addr{};
+    socklen_t addr_len = sizeof(addr);
+    TEST(getsockname(listen_fd, (sockaddr *)&addr, &addr_len) == 0);
+    std::cout.flush();
+    pid_t server = fork();
+    if (server == 0)
+    {
+      run_server(listen_fd);
+      _exit(0);
+    }
+    close(listen_fd);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    TEST(connect(fd, (sockaddr *)&addr, sizeof(addr)) == 0);
+    // A server that stops reading without hanging up fails the test instead of blocking it
+    timeval timeout{5, 0};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    const std::string chunk(1 << 20, 'a');
+    size_t sent = 0;
+    ssize_t n;
+    while (sent < 2 * MAX_REQUEST_SIZE && (n = send(fd, chunk.data(), chunk.size(), MSG_NOSIGNAL)) > 0)
+      sent += n;
+    int err = errno;
+    close(fd);
+    kill(server, SIGKILL);
+    waitpid(server, nullptr, 0);
+
+    // What got past the limit is what the socket buffers held when the server hung up
+    TEST(err == EPIPE || err == ECONNRESET);
+    TEST(sent < MAX_REQUEST_SIZE + (16u << 20));
+  }
+
+  // Test 7: reaping an expired entry while the save is partway through its node leaves the node's other entries in
+  // the snapshot
+  for (int steps = 1; steps < 40; ++steps)
+  {
+    // Every fourth entry lives until second 1, which passes once the save is under way
+    coarse_clock::NOW_MS = 0;
+    Tree tree;
+    tree.insert("a");
+    for (int i = 0; i < 400; ++i)
+      (void)tree.set("a", std::format("k{}", i), std::string_view("v"), i % 4 == 0 ? 1 : 0);
+    coarse_clock::NOW_MS = 2000;
+
+    Snapshot_writer writer;
+    tree.begin_save(writer);
+    for (int i = 0; i < steps; ++i) tree.save(8);
+    std::size_t reaped = 0;
+    for (int i = 0; i < 400; i += 4) reaped += tree.reap("a", std::format("k{}", i));
+    while (tree.save(64));
+    TEST(reaped == 100);
+
+    std::size_t entries = 0;
+    std::string blocks = writer.output();
+    for (size_t at = 0; at < blocks.size();)
+    {
+      auto body = next_block(blocks, at);
+      TEST(body.has_value());
+      TEST(decode_block(*body, [](std::span<const std::string_view>, uint32_t) {},
+                        [&](std::string_view, const Leaf_value &, uint32_t) { ++entries; }));
+    }
+    TEST(entries == 300);
+  }
+
+  // Test 8: an expired node nobody has reaped yet is gone for rmtree too, and stays in place for the reaper
+  {
+    coarse_clock::NOW_MS = 0;
+    Tree tree;
+    tree.insert("a/b");
+    (void)tree.expire("a/b", 1);
+    TEST(tree.remove("a/b"));
+    tree.insert("a/b");
+    (void)tree.expire("a/b", 1);
+    coarse_clock::NOW_MS = 2000;
+    TEST(!tree.remove("a/b"));
+    TEST(!tree.remove("a/b/"));
+    TEST(tree.reap("a/b", ""));
+    TEST(tree.remove("a"));
+    coarse_clock::NOW_MS = 0;
+  }
+
+  std::cout << "All tests passed successfully!" << std::endl;
+  return 0;
+}